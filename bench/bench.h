@@ -0,0 +1,89 @@
+/* tolua: benchmark helpers
+** Support code for Lua bindings.
+*/
+
+/*
+ *  各个测试程序共用的计时函数，只用到旧版本也有的公开接口，
+ *  同一个测试程序可以分别和改动前后的tolua++编译，比较两次的结果：
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_operator.c -o bench_operator -llua5.1 -lm
+ *      ./bench_operator
+ *
+ *  计时用单调时钟（POSIX的clock_gettime），结果是墙上时间。
+ *  每项重复执行，取最短的一次，减少机器上其它负载的干扰
+ */
+
+#ifndef TOLUA_BENCH_H
+#define TOLUA_BENCH_H
+
+#include "tolua++.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ *  @return 单调时钟的秒数
+ */
+static double bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+/**
+ *  创建状态机并打开标准库和tolua
+ */
+static lua_State* bench_open (void)
+{
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    tolua_open(L);
+    return L;
+}
+
+/* 每项的重复次数 */
+#ifndef BENCH_REPEAT
+#define BENCH_REPEAT    5
+#endif
+
+/**
+ *  执行一段lua代码times次，输出最短的用时，出错时输出错误信息并退出
+ *
+ *  @param L     状态机
+ *  @param name  测试项的名字
+ *  @param chunk lua代码
+ *  @param times 次数，代码不能重复执行时为1
+ *
+ *  @return 最短用时（秒）
+ */
+static double bench_run (lua_State* L, const char* name, const char* chunk, int times)
+{
+    double best = 0;
+    int i;
+    for (i=0; i<times; ++i)
+    {
+        double t;
+        if (luaL_loadstring(L,chunk) != 0)
+        {
+            fprintf(stderr,"%s: %s\n",name,lua_tostring(L,-1));
+            exit(1);
+        }
+        t = bench_now();
+        if (lua_pcall(L,0,0,0) != 0)
+        {
+            fprintf(stderr,"%s: %s\n",name,lua_tostring(L,-1));
+            exit(1);
+        }
+        t = bench_now() - t;
+        if (i == 0 || t < best)
+            best = t;
+    }
+    printf("%-40s %10.2f ms\n",name,best*1e3);
+    return best;
+}
+
+#endif
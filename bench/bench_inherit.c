@@ -0,0 +1,90 @@
+/* tolua: inheritance depth benchmark
+** Support code for Lua bindings.
+*/
+
+/*
+ *  继承深度1到10的成员查找：方法和get函数都定义在基类C0上，
+ *  对象的类是Cd（C0的d层子类），每次访问都要找到d层以上
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_inherit.c -o bench_inherit -llua5.1 -lm
+ */
+
+#include "bench.h"
+
+#define DEPTH 10
+
+typedef struct Node
+{
+    double x;
+} Node;
+
+static Node nodes[DEPTH+1];
+
+static int get_x (lua_State* L)
+{
+    lua_pushnumber(L,((Node*)tolua_tousertype(L,1,0))->x);
+    return 1;
+}
+
+static int node_m (lua_State* L)
+{
+    lua_pushnumber(L,((Node*)tolua_tousertype(L,1,0))->x);
+    return 1;
+}
+
+/* 压入C<d>类的对象 */
+static int node_get (lua_State* L)
+{
+    char name[16];
+    int d = (int)lua_tonumber(L,1);
+    sprintf(name,"C%d",d);
+    tolua_pushusertype(L,&nodes[d],name);
+    return 1;
+}
+
+static void open_nodes (lua_State* L)
+{
+    char name[16], base[16];
+    int d;
+    for (d=0; d<=DEPTH; ++d)
+    {
+        sprintf(name,"C%d",d);
+        tolua_usertype(L,name);
+    }
+    tolua_module(L,NULL,0);
+    tolua_beginmodule(L,NULL);
+        for (d=0; d<=DEPTH; ++d)
+        {
+            sprintf(name,"C%d",d);
+            sprintf(base,"C%d",d-1);
+            tolua_cclass(L,name,name,d ? base : "",NULL);
+        }
+        tolua_beginmodule(L,"C0");
+            tolua_function(L,"get",node_get);
+            tolua_function(L,"m",node_m);
+            tolua_variable(L,"x",get_x,NULL);
+        tolua_endmodule(L);
+    tolua_endmodule(L);
+}
+
+int main (void)
+{
+    char name[64], chunk[128];
+    int d;
+    lua_State* L = bench_open();
+    open_nodes(L);
+    (void)luaL_dostring(L,"N = 1000000");
+
+    for (d=1; d<=DEPTH; ++d)
+    {
+        sprintf(chunk,"o = C0.get(%d)",d);
+        (void)luaL_dostring(L,chunk);
+        sprintf(name,"depth %2d  o:m()  (method)",d);
+        bench_run(L,name,"local o, v = o, 0 for i=1,N do v = v + o:m() end",BENCH_REPEAT);
+        sprintf(name,"depth %2d  o.x    (get function)",d);
+        bench_run(L,name,"local o, v = o, 0 for i=1,N do v = v + o.x end",BENCH_REPEAT);
+    }
+
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* tolua: member access benchmark
+** Support code for Lua bindings.
+*/
+
+/*
+ *  对象成员访问：get函数、set函数、方法调用和peer表中的lua字段
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_member.c -o bench_member -llua5.1 -lm
+ */
+
+#include "bench.h"
+
+typedef struct Sprite
+{
+    double x;
+    int tag;
+} Sprite;
+
+static Sprite* self (lua_State* L)
+{
+    return (Sprite*)tolua_tousertype(L,1,0);
+}
+
+static int get_x (lua_State* L)
+{
+    lua_pushnumber(L,self(L)->x);
+    return 1;
+}
+
+static int set_x (lua_State* L)
+{
+    self(L)->x = lua_tonumber(L,2);
+    return 0;
+}
+
+static int get_tag (lua_State* L)
+{
+    lua_pushnumber(L,self(L)->tag);
+    return 1;
+}
+
+static Sprite sprite;
+
+static int sprite_get (lua_State* L)
+{
+    tolua_pushusertype(L,&sprite,"Sprite");
+    return 1;
+}
+
+int main (void)
+{
+    lua_State* L = bench_open();
+    tolua_usertype(L,"Sprite");
+    tolua_module(L,NULL,0);
+    tolua_beginmodule(L,NULL);
+        tolua_cclass(L,"Sprite","Sprite","",NULL);
+        tolua_beginmodule(L,"Sprite");
+            tolua_function(L,"get",sprite_get);
+            tolua_function(L,"getTag",get_tag);
+            tolua_variable(L,"x",get_x,set_x);
+        tolua_endmodule(L);
+    tolua_endmodule(L);
+    (void)luaL_dostring(L,"s = Sprite.get() s.lua = 1 N = 3000000");
+
+    bench_run(L,"s.x         (get function)",
+              "local s, v = s, 0 for i=1,N do v = v + s.x end",BENCH_REPEAT);
+    bench_run(L,"s.x = i     (set function)",
+              "local s = s for i=1,N do s.x = i end",BENCH_REPEAT);
+    bench_run(L,"s:getTag()  (method)",
+              "local s, v = s, 0 for i=1,N do v = v + s:getTag() end",BENCH_REPEAT);
+    bench_run(L,"s.lua       (peer field)",
+              "local s, v = s, 0 for i=1,N do v = v + s.lua end",BENCH_REPEAT);
+    bench_run(L,"s.lua = i   (peer field)",
+              "local s = s for i=1,N do s.lua = i end",BENCH_REPEAT);
+
+    lua_close(L);
+    return 0;
+}
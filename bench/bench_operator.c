@@ -0,0 +1,138 @@
+/* tolua: operator dispatch benchmark
+** Support code for Lua bindings.
+*/
+
+/*
+ *  向量运算：运算符和对应的方法调用
+ *
+ *  对象的类是Vec3的两层子类，运算函数定义在Vec3上，
+ *  旧的分发每次运算都沿元表链查找，现在注册时就设为子类的元方法
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_operator.c -o bench_operator -llua5.1 -lm
+ */
+
+#include "bench.h"
+
+typedef struct Vec3
+{
+    double x, y, z;
+} Vec3;
+
+static Vec3* checkvec (lua_State* L, int lo)
+{
+    tolua_Error err;
+    if (!tolua_isusertype(L,lo,"Vec3",0,&err))
+        tolua_error(L,"#ferror in function 'Vec3'.",&err);
+    return (Vec3*)tolua_tousertype(L,lo,0);
+}
+
+static void pushvec (lua_State* L, Vec3* v)
+{
+    void* p = tolua_copy(L,v,sizeof(Vec3));
+    tolua_pushusertype(L,p,"Vec3C");
+    tolua_register_gc(L,lua_gettop(L));
+}
+
+static int vec_new (lua_State* L)
+{
+    Vec3 v;
+    v.x = lua_tonumber(L,2);
+    v.y = lua_tonumber(L,3);
+    v.z = lua_tonumber(L,4);
+    pushvec(L,&v);
+    return 1;
+}
+
+static int vec_add (lua_State* L)
+{
+    Vec3* a = checkvec(L,1);
+    Vec3* b = checkvec(L,2);
+    Vec3 r;
+    r.x = a->x + b->x;
+    r.y = a->y + b->y;
+    r.z = a->z + b->z;
+    pushvec(L,&r);
+    return 1;
+}
+
+static int vec_dot (lua_State* L)
+{
+    Vec3* a = checkvec(L,1);
+    Vec3* b = checkvec(L,2);
+    lua_pushnumber(L,a->x*b->x + a->y*b->y + a->z*b->z);
+    return 1;
+}
+
+static int vec_sub (lua_State* L)
+{
+    Vec3* a = checkvec(L,1);
+    Vec3* b = checkvec(L,2);
+    lua_pushnumber(L,a->x - b->x);
+    return 1;
+}
+
+static int vec_lt (lua_State* L)
+{
+    lua_pushboolean(L,checkvec(L,1)->x < checkvec(L,2)->x);
+    return 1;
+}
+
+static int vec_unm (lua_State* L)
+{
+    lua_pushnumber(L,-checkvec(L,1)->x);
+    return 1;
+}
+
+static void open_vec (lua_State* L)
+{
+    tolua_usertype(L,"Vec3");
+    tolua_usertype(L,"Vec3B");
+    tolua_usertype(L,"Vec3C");
+    tolua_module(L,NULL,0);
+    tolua_beginmodule(L,NULL);
+        tolua_cclass(L,"Vec3","Vec3","",NULL);
+        tolua_cclass(L,"Vec3B","Vec3B","Vec3",NULL);
+        tolua_cclass(L,"Vec3C","Vec3C","Vec3B",NULL);
+        tolua_beginmodule(L,"Vec3");
+            tolua_function(L,"new",vec_new);
+            tolua_function(L,"add",vec_add);
+            tolua_function(L,"dot",vec_dot);
+            tolua_function(L,"sub",vec_sub);
+            tolua_function(L,".add",vec_add);
+            tolua_function(L,".mul",vec_dot);
+            tolua_function(L,".sub",vec_sub);
+            tolua_function(L,".lt",vec_lt);
+            tolua_function(L,".unm",vec_unm);
+        tolua_endmodule(L);
+    tolua_endmodule(L);
+}
+
+int main (void)
+{
+    lua_State* L = bench_open();
+    open_vec(L);
+    (void)luaL_dostring(L,"a = Vec3:new(1,2,3) b = Vec3:new(4,5,6) N = 2000000");
+
+    bench_run(L,"a*b      (operator, dot)",
+              "local a, b, s = a, b, 0 for i=1,N do s = s + a*b end",BENCH_REPEAT);
+    bench_run(L,"a:dot(b) (method)",
+              "local a, b, s = a, b, 0 for i=1,N do s = s + a:dot(b) end",BENCH_REPEAT);
+    bench_run(L,"a-b      (operator)",
+              "local a, b, s = a, b, 0 for i=1,N do s = s + (a-b) end",BENCH_REPEAT);
+    bench_run(L,"a:sub(b) (method)",
+              "local a, b, s = a, b, 0 for i=1,N do s = s + a:sub(b) end",BENCH_REPEAT);
+    bench_run(L,"a<b      (operator)",
+              "local a, b, n = a, b, 0 for i=1,N do if a<b then n = n + 1 end end",BENCH_REPEAT);
+    bench_run(L,"a+b      (operator, new object)",
+              "local a, b = a, b for i=1,N/4 do local c = a+b end",BENCH_REPEAT);
+    bench_run(L,"a:add(b) (method, new object)",
+              "local a, b = a, b for i=1,N/4 do local c = a:add(b) end",BENCH_REPEAT);
+    if (luaL_dostring(L,"return -a") == 0)
+        bench_run(L,"-a       (operator)",
+                  "local a, s = a, 0 for i=1,N do s = s + (-a) end",BENCH_REPEAT);
+    else
+        printf("%-40s %10s\n","-a       (operator)","unsupported");
+
+    lua_close(L);
+    return 0;
+}
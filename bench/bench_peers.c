@@ -0,0 +1,64 @@
+/* tolua: peer table gc benchmark
+** Support code for Lua bindings.
+*/
+
+/*
+ *  10万个对象时一次完整垃圾回收的耗时：
+ *  没有peer、peer在用户数据上（5.1环境表，5.2以上uservalue）、
+ *  以及旧的5.2以上做法，peer放在一个弱键表里（reg.tolua_peers）
+ *
+ *  弱键表在5.2以上是ephemeron表，每次回收都要反复遍历，用5.2以上编译时差别最明显
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_peers.c -o bench_peers -llua5.1 -lm
+ */
+
+#include "bench.h"
+
+#define COUNT 100000
+
+typedef struct Obj
+{
+    int id;
+} Obj;
+
+static Obj objs[COUNT];
+
+/* 压入第i个对象 */
+static int obj_get (lua_State* L)
+{
+    int i = (int)lua_tonumber(L,1);
+    if (i < 1 || i > COUNT)
+        return 0;
+    tolua_pushusertype(L,&objs[i-1],"Obj");
+    return 1;
+}
+
+int main (void)
+{
+    lua_State* L = bench_open();
+    tolua_usertype(L,"Obj");
+    tolua_module(L,NULL,0);
+    tolua_beginmodule(L,NULL);
+        tolua_cclass(L,"Obj","Obj","",NULL);
+        tolua_beginmodule(L,"Obj");
+            tolua_function(L,"get",obj_get);
+        tolua_endmodule(L);
+    tolua_endmodule(L);
+
+    (void)luaL_dostring(L,"N = 100000 objs = {} for i=1,N do objs[i] = Obj.get(i) end");
+    bench_run(L,"100k objects, no peer",
+              "collectgarbage('collect')",BENCH_REPEAT);
+
+    (void)luaL_dostring(L,"peers = setmetatable({},{__mode='k'}) "
+                          "for i=1,N do peers[objs[i]] = {tag=i} end");
+    bench_run(L,"100k objects, peer in weak-keyed table",
+              "collectgarbage('collect')",BENCH_REPEAT);
+
+    (void)luaL_dostring(L,"peers = nil collectgarbage('collect') "
+                          "for i=1,N do objs[i].tag = i end");
+    bench_run(L,"100k objects, peer on userdata",
+              "collectgarbage('collect')",BENCH_REPEAT);
+
+    lua_close(L);
+    return 0;
+}
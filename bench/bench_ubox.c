@@ -0,0 +1,61 @@
+/* tolua: object table benchmark
+** Support code for Lua bindings.
+*/
+
+/*
+ *  同一批c对象反复入栈：第一次入栈创建用户数据并登记在对象表中，
+ *  之后的入栈按地址找到已有的用户数据。分别测试1万、10万、100万个对象
+ *
+ *      gcc -O2 -I. -Itolua tolua/tolua_*.c bench/bench_ubox.c -o bench_ubox -llua5.1 -lm
+ */
+
+#include "bench.h"
+
+typedef struct Node
+{
+    double x, y;
+    int id;
+} Node;
+
+static Node** objs;
+
+static int node_push (lua_State* L)
+{
+    tolua_pushusertype(L,objs[(int)lua_tonumber(L,1)-1],"Node");
+    return 1;
+}
+
+int main (void)
+{
+    static const int counts[] = {10000, 100000, 1000000};
+    int i, k;
+    char name[64];
+
+    objs = (Node**)malloc(counts[2]*sizeof(Node*));
+    for (i=0; i<counts[2]; ++i)
+        objs[i] = (Node*)calloc(1,sizeof(Node));
+
+    for (k=0; k<3; ++k)
+    {
+        lua_State* L = bench_open();
+        tolua_usertype(L,"Node");
+        tolua_module(L,NULL,0);
+        tolua_beginmodule(L,NULL);
+            tolua_cclass(L,"Node","Node","",NULL);
+            tolua_function(L,"push",node_push);
+        tolua_endmodule(L);
+        lua_pushnumber(L,counts[k]);
+        lua_setglobal(L,"N");
+
+        sprintf(name,"%7d objects: first push",counts[k]);
+        bench_run(L,name,"keep = {} local t = keep for i=1,N do t[i] = push(i) end",1);
+        sprintf(name,"%7d objects: lookup x %d",counts[k],3000000/counts[k]);
+        bench_run(L,name,"for r=1,3000000/N do for i=1,N do push(i) end end",BENCH_REPEAT);
+        lua_close(L);
+    }
+
+    for (i=0; i<counts[2]; ++i)
+        free(objs[i]);
+    free(objs);
+    return 0;
+}
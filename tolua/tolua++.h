@@ -43,6 +43,9 @@ extern "C" {
 
 #define TOLUA_VALUE_ROOT "tolua_value_root"
 
+/* 类型id中的const标志位，tolua_typeid(L,"const X") == (tolua_typeid(L,"X") | TOLUA_TYPE_CONST) */
+#define TOLUA_TYPE_CONST 0x40000000
+
 typedef int lua_Object;
 
 #include "lua.h"
@@ -56,7 +59,115 @@ struct tolua_Error
 };
 typedef struct tolua_Error tolua_Error;
 
-#define TOLUA_NOPEER    LUA_REGISTRYINDEX /* for lua 5.1 */
+/* 对象的回收方式，见tolua_collectmode */
+#define TOLUA_COLLECT_INHERIT      -1   /* 跟随主基类（默认），根类是TOLUA_COLLECT_NOW */
+#define TOLUA_COLLECT_NOW           0   /* 在__gc中立即调用回收函数 */
+#define TOLUA_COLLECT_DEFER         1   /* 放入队列，由tolua_drain_collect调用 */
+#define TOLUA_COLLECT_THREADSAFE    2   /* 放入队列，可由tolua_take_collect取出在其它线程析构 */
+
+/* 不访问lua_State的对象函数（析构、retain、release），可以在任意线程调用 */
+typedef void (*tolua_Destructor) (void* p);
+
+/* 对象持有的原生内存字节数（lua看不到的部分），见tolua_extclass */
+typedef size_t (*tolua_ExternalSize) (void* p);
+
+/* tolua_take_collect取出的对象 */
+typedef struct tolua_Garbage
+{
+    void* ptr;
+    tolua_Destructor dtor;
+} tolua_Garbage;
+
+/* 类的静态描述，用于tolua_classdefs一次性注册，各列表以name为NULL的项结束 */
+typedef struct tolua_Reg
+{
+    const char* name;
+    lua_CFunction func;
+} tolua_Reg;
+
+typedef struct tolua_VarReg
+{
+    const char* name;
+    lua_CFunction get;
+    lua_CFunction set;              /* NULL表示只读 */
+} tolua_VarReg;
+
+typedef struct tolua_ConstReg
+{
+    const char* name;
+    lua_Number value;
+} tolua_ConstReg;
+
+/* 数组协议中元素的类型 */
+#define TOLUA_ELEM_DOUBLE       1
+#define TOLUA_ELEM_FLOAT        2
+#define TOLUA_ELEM_INT          3
+#define TOLUA_ELEM_UINT         4
+#define TOLUA_ELEM_SHORT        5
+#define TOLUA_ELEM_USHORT       6
+#define TOLUA_ELEM_CHAR         7
+#define TOLUA_ELEM_UCHAR        8
+#define TOLUA_ELEM_BOOL         9   /* 1字节，同C++的bool */
+#define TOLUA_ELEM_USERTYPE     10  /* 元素按地址以type类型入栈 */
+
+/* 类似数组的类型：obj[i]、tolua.readrange、tolua.writerange直接读写元素，下标从0开始 */
+typedef struct tolua_ArrayDef
+{
+    int elem;                       /* TOLUA_ELEM_* */
+    const char* type;               /* TOLUA_ELEM_USERTYPE时的元素类型名 */
+    size_t size;                    /* TOLUA_ELEM_USERTYPE时的元素大小 */
+    int (*length) (void* self);     /* 元素个数 */
+    void* (*data) (void* self);     /* 首元素地址，NULL表示对象本身就是首元素 */
+} tolua_ArrayDef;
+
+typedef struct tolua_ClassDef
+{
+    const char* lname;              /* 模块中的名字 */
+    const char* name;               /* 类型名 */
+    const char* base;               /* 基类名，""表示没有 */
+    lua_CFunction col;              /* 垃圾回收函数 */
+    const char* const* bases;       /* 其余基类（多重继承），以NULL结束，可为NULL */
+    const tolua_Reg* methods;
+    const tolua_Reg* operators;     /* ".add" ".eq" ".call" 等 */
+    const tolua_VarReg* variables;
+    const tolua_VarReg* arrays;
+    const tolua_ConstReg* constants;
+    const tolua_ArrayDef* array;    /* 数组协议，可为NULL */
+    int sealed;                     /* 非0表示密封，见tolua_sealclass */
+    unsigned int size;              /* 非0表示值类型的大小，见tolua_valueclass */
+    tolua_Destructor retain;        /* 引用计数策略，见tolua_refclass，可为NULL */
+    tolua_Destructor release;
+    tolua_ExternalSize extsize;     /* 对象持有的原生内存，见tolua_extclass，可为NULL */
+    const char* const* slots;       /* 声明的lua端字段，以NULL结束，见tolua_slotclass，可为NULL */
+} tolua_ClassDef;
+
+/* 内存池的尺寸级别数量 */
+#define TOLUA_SLAB_CLASSES      8
+
+/*
+ *  tolua_copy的拷贝对象从状态机的内存池中分配，只能用tolua_free（或tolua_default_collect）释放，不能free。
+ *  释放了所有权交给c端的拷贝对象在lua_close之后依然有效，但不再能释放。
+ *  自己free拷贝对象、或者需要在状态机关闭之后释放的旧代码，编译tolua时把它定义为1，拷贝对象改用malloc
+ */
+#ifndef TOLUA_COPY_MALLOC
+#define TOLUA_COPY_MALLOC       0
+#endif
+
+/* 内存池占用情况，见tolua_slabstats */
+typedef struct tolua_SlabStats
+{
+    size_t pagebytes;               /* 已分配的页的总字节数 */
+    size_t usedbytes;               /* 正在使用的块的总字节数 */
+    size_t large;                   /* 超过最大尺寸、直接malloc的块的数量 */
+    struct
+    {
+        size_t size;                /* 块大小 */
+        size_t blocks;              /* 块总数 */
+        size_t used;                /* 正在使用的块数 */
+    } classes[TOLUA_SLAB_CLASSES];
+} tolua_SlabStats;
+
+#define TOLUA_NOPEER    LUA_REGISTRYINDEX /* for lua 5.1 and later */
 
 TOLUA_API const char* tolua_typename (lua_State* L, int lo);
 TOLUA_API void tolua_error (lua_State* L, const char* msg, tolua_Error* err);
@@ -70,6 +181,7 @@ TOLUA_API int tolua_istable (lua_State* L, int lo, int def, tolua_Error* err);
 TOLUA_API int tolua_isusertable (lua_State* L, int lo, const char* type, int def, tolua_Error* err);
 TOLUA_API int tolua_isuserdata (lua_State* L, int lo, int def, tolua_Error* err);
 TOLUA_API int tolua_isusertype (lua_State* L, int lo, const char* type, int def, tolua_Error* err);
+TOLUA_API int tolua_isusertype_id (lua_State* L, int lo, int type, int def, tolua_Error* err);
 TOLUA_API int tolua_isvaluearray
 (lua_State* L, int lo, int dim, int def, tolua_Error* err);
 TOLUA_API int tolua_isbooleanarray
@@ -88,10 +200,22 @@ TOLUA_API int tolua_isusertypearray
 TOLUA_API void tolua_open (lua_State* L);
 
 TOLUA_API void* tolua_copy (lua_State* L, void* value, unsigned int size);
+TOLUA_API void* tolua_alloc (lua_State* L, size_t size);
+TOLUA_API void tolua_free (lua_State* L, void* p);
+TOLUA_API void tolua_slabstats (lua_State* L, tolua_SlabStats* stats);
+TOLUA_API void tolua_collectmode (lua_State* L, const char* type, int mode, tolua_Destructor dtor);
+TOLUA_API void tolua_refclass (lua_State* L, const char* type, tolua_Destructor retain, tolua_Destructor release);
+TOLUA_API void tolua_extclass (lua_State* L, const char* type, tolua_ExternalSize extsize);
+TOLUA_API void tolua_report_external (lua_State* L, long bytes);
+TOLUA_API size_t tolua_externalbytes (lua_State* L);
+TOLUA_API int tolua_drain_collect (lua_State* L, int budget_us);
+TOLUA_API int tolua_take_collect (lua_State* L, tolua_Garbage* out, int n);
 TOLUA_API int tolua_register_gc (lua_State* L, int lo);
 TOLUA_API int tolua_default_collect (lua_State* tolua_S);
 
-TOLUA_API void tolua_usertype (lua_State* L, const char* type);
+TOLUA_API int tolua_usertype (lua_State* L, const char* type);
+TOLUA_API int tolua_typeid (lua_State* L, const char* type);
+TOLUA_API const char* tolua_typeidname (lua_State* L, int id);
 TOLUA_API void tolua_beginmodule (lua_State* L, const char* name);
 TOLUA_API void tolua_endmodule (lua_State* L);
 TOLUA_API void tolua_module (lua_State* L, const char* name, int hasvar);
@@ -101,9 +225,17 @@ TOLUA_API void tolua_function (lua_State* L, const char* name, lua_CFunction fun
 TOLUA_API void tolua_constant (lua_State* L, const char* name, lua_Number value);
 TOLUA_API void tolua_variable (lua_State* L, const char* name, lua_CFunction get, lua_CFunction set);
 TOLUA_API void tolua_array (lua_State* L,const char* name, lua_CFunction get, lua_CFunction set);
+TOLUA_API void tolua_classdefs (lua_State* L, const tolua_ClassDef* defs);
+TOLUA_API void tolua_lazyclassdefs (lua_State* L, const tolua_ClassDef* defs);
+TOLUA_API void tolua_lazymodule (lua_State* L, const char* name, lua_CFunction open);
+TOLUA_API void tolua_arrayclass (lua_State* L, const char* type, const tolua_ArrayDef* def);
+TOLUA_API void tolua_sealclass (lua_State* L, const char* type, int sealed);
+TOLUA_API void tolua_slotclass (lua_State* L, const char* type, const char* const* names);
+TOLUA_API void tolua_valueclass (lua_State* L, const char* type, unsigned int size);
 
 /* TOLUA_API void tolua_set_call_event(lua_State* L, lua_CFunction func, char* type); */
 TOLUA_API void tolua_addbase(lua_State* L, char* name, char* base);
+TOLUA_API void tolua_finalize_types (lua_State* L);
 
 TOLUA_API void tolua_pushvalue (lua_State* L, int lo);
 TOLUA_API void tolua_pushboolean (lua_State* L, int value);
@@ -111,7 +243,10 @@ TOLUA_API void tolua_pushnumber (lua_State* L, lua_Number value);
 TOLUA_API void tolua_pushstring (lua_State* L, const char* value);
 TOLUA_API void tolua_pushuserdata (lua_State* L, void* value);
 TOLUA_API void tolua_pushusertype (lua_State* L, void* value, const char* type);
+TOLUA_API void tolua_pushusertype_id (lua_State* L, void* value, int type);
 TOLUA_API void tolua_pushusertype_and_takeownership(lua_State* L, void* value, const char* type);
+TOLUA_API void* tolua_pushvaluetype (lua_State* L, const void* value, const char* type);
+TOLUA_API void* tolua_pushvaluetype_id (lua_State* L, const void* value, int type);
 TOLUA_API void tolua_pushfieldvalue (lua_State* L, int lo, int index, int v);
 TOLUA_API void tolua_pushfieldboolean (lua_State* L, int lo, int index, int v);
 TOLUA_API void tolua_pushfieldnumber (lua_State* L, int lo, int index, lua_Number v);
@@ -123,11 +258,13 @@ TOLUA_API void tolua_pushfieldusertype_and_takeownership (lua_State* L, int lo,
 TOLUA_API void tolua_pushusertype_and_addtoroot (lua_State* L, void* value, const char* type);
 TOLUA_API void tolua_add_value_to_root (lua_State* L,void* value);
 TOLUA_API void tolua_remove_value_from_root (lua_State* L, void* value);
+TOLUA_API int tolua_invalidate (lua_State* L, void* ptr);
 
 TOLUA_API lua_Number tolua_tonumber (lua_State* L, int narg, lua_Number def);
 TOLUA_API const char* tolua_tostring (lua_State* L, int narg, const char* def);
 TOLUA_API void* tolua_touserdata (lua_State* L, int narg, void* def);
 TOLUA_API void* tolua_tousertype (lua_State* L, int narg, void* def);
+TOLUA_API void* tolua_tousertype_id (lua_State* L, int narg, int type, void* def);
 TOLUA_API int tolua_tovalue (lua_State* L, int narg, int def);
 TOLUA_API int tolua_toboolean (lua_State* L, int narg, int def);
 TOLUA_API lua_Number tolua_tofieldnumber (lua_State* L, int lo, int index, lua_Number def);
@@ -177,6 +314,8 @@ TOLUA_API int tolua_fast_isa(lua_State *L, int mt_indexa, int mt_indexb, int sup
 #define Mtolua_delete_dim(EXP) delete [] EXP
 #endif
 
+/* Mtolua_slab_new、Mtolua_slab_delete在tolua_new.h中（只用于c++） */
+
 #ifndef tolua_outside
 #define tolua_outside
 #endif
@@ -13,8 +13,130 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "tolua++.h"
+#include "tolua_type.h"
+#include "tolua_event.h"
+
+/*
+ *  事件闭包的upvalue
+ *
+ *  键字符串在注册时内部化一次，之后每次事件直接 lua_pushvalue，不再散列c字符串
+ */
+#define TOLUA_UPV_GET       lua_upvalueindex(1)     /* ".get"        */
+#define TOLUA_UPV_SET       lua_upvalueindex(2)     /* ".set"        */
+#define TOLUA_UPV_GETI      lua_upvalueindex(3)     /* ".geti"       */
+#define TOLUA_UPV_SETI      lua_upvalueindex(4)     /* ".seti"       */
+#define TOLUA_UPV_SELF      lua_upvalueindex(5)     /* ".self"       */
+#define TOLUA_UPV_INDEX     lua_upvalueindex(6)     /* "__index"     */
+#define TOLUA_UPV_NEWINDEX  lua_upvalueindex(7)     /* "__newindex"  */
+#define TOLUA_UPV_PEERS     lua_upvalueindex(8)     /* reg.tolua_peers，lua5.1以上为nil */
+#define TOLUA_UPV_LAZY      lua_upvalueindex(9)     /* ".lazy"       */
+#define TOLUA_UPV_CTX       lua_upvalueindex(10)    /* tolua_Context */
+#define TOLUA_UPV_PROXIES   lua_upvalueindex(11)    /* ".proxies"    */
+#define TOLUA_NUPV          11
+
+/* 运算、比较、调用事件的upvalue */
+#define TOLUA_UPV_OP        lua_upvalueindex(1)     /* 类表中的键，如".add" */
+#define TOLUA_UPV_EVENT     lua_upvalueindex(2)     /* 元方法名，如"__add" */
+#define TOLUA_UPV_OPCTX     lua_upvalueindex(3)     /* tolua_Context */
+#define TOLUA_NOPUV         3
+
+/**
+ *  类表中的运算函数和对应的元方法
+ *
+ *  shared为1的元方法所有类都有，没有运算函数时是报错的查找闭包；
+ *  为0的只设置在自己定义了或者继承了运算函数的类上，其它类保持lua的默认行为
+ */
+static const struct
+{
+    const char* key;
+    const char* event;
+    int shared;
+} tolua_operators[] =
+{
+    {".add","__add",1}, {".sub","__sub",1}, {".mul","__mul",1}, {".div","__div",1},
+    {".mod","__mod",1}, {".pow","__pow",1}, {".unm","__unm",0},
+    {".concat","__concat",0}, {".len","__len",0},
+    {NULL,NULL,0}
+};
+
+/**
+ *  查询运算函数的键
+ *
+ *  @param key 类表中的键
+ *
+ *  @return tolua_operators中的下标，-1表示不是运算函数
+ */
+static int operatorindex (const char* key)
+{
+    int i;
+    for (i=0; tolua_operators[i].key; ++i)
+        if (strcmp(tolua_operators[i].key,key) == 0)
+            return i;
+    return -1;
+}
+
+/**
+ *  查询键在对象的peer表中的数组下标
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param type 对象的类型id
+ *  @param lo   键在栈中位置
+ *
+ *  @return 声明的字段的下标，0表示不是声明的字段
+ */
+static int slotindex (lua_State* L, tolua_Context* ctx, int type, int lo)
+{
+    tolua_Type* t;
+    int i;
+    if (lua_type(L,lo) != LUA_TSTRING || (t = tolua_slotpolicy(ctx,type)) == NULL)
+        return 0;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,t->slots);
+    lua_pushvalue(L,lo);
+    lua_rawget(L,-2);                   /* stack: slots i */
+    i = (int)lua_tointeger(L,-1);
+    lua_pop(L,2);
+    return i;
+}
+
+/**
+ *  peer表不再按声明的字段存放：数组部分的字段改为以名字为键，去掉TOLUA_BOX_SLOTPEER
+ *
+ *  peer表交给lua（tolua.getpeer），或者要存入整数键（和数组部分冲突）时调用
+ *
+ *  @param L   状态机
+ *  @param box 数据块
+ *  @param lo  用户数据栈中位置
+ */
+TOLUA_API void tolua_unslotpeer (lua_State* L, tolua_Box* box, int lo)
+{
+    tolua_Type* t;
+    if (!(box->flags & TOLUA_BOX_SLOTPEER))
+        return;
+    box->flags &= ~TOLUA_BOX_SLOTPEER;
+    t = tolua_slotpolicy(tolua_context(L),box->type);
+    if (t == NULL)
+        return;
+    if (lo < 0)
+        lo = lua_gettop(L) + lo + 1;
+    tolua_getpeertable(L,lo);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,t->slots);  /* stack: env slots */
+    lua_pushnil(L);
+    while (lua_next(L,-2) != 0)             /* stack: env slots name i */
+    {
+        int i = (int)lua_tointeger(L,-1);
+        lua_pop(L,1);
+        lua_pushvalue(L,-1);
+        lua_rawgeti(L,-4,i);
+        lua_rawset(L,-5);                   /* env[name] = env[i] */
+        lua_pushnil(L);
+        lua_rawseti(L,-4,i);                /* env[i] = nil */
+    }
+    lua_pop(L,2);
+}
 
 /**
  *  Store at ubox
@@ -28,26 +150,59 @@
  *
  *  obj.env[k] = v
  *
- *  @param L  状态机
- *  @param lo 用户数据栈中位置
+ *  类声明过的字段存放在环境表的数组部分，见tolua_slotclass。
+ *  只用于这里创建的环境表，tolua.setpeer设置的表按普通的键存放
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ *  @param box 对象的数据块，不是tolua的用户数据时为NULL
+ *  @param lo  用户数据栈中位置
  */
-static void storeatubox (lua_State* L, int lo)
+static void storeatubox (lua_State* L, tolua_Context* ctx, tolua_Box* box, int lo)
 {
-#ifdef LUA_VERSION_NUM                  /* lua 5.1 */
+#ifdef LUA_VERSION_NUM
+    /* 声明的字段在环境表中的下标，键在栈中-2处 */
+    tolua_Type* t = box ? tolua_slotpolicy(ctx,box->type) : NULL;
+    int slot = 0;
+#endif
+
+    /* 记下对象有peer表，之后查找成员时才需要查peer */
+    if (box)
+        box->flags |= TOLUA_BOX_HASPEER;
+
+#ifdef LUA_VERSION_NUM                  /* lua 5.1以上，环境表或uservalue */
     /* 获得 用户数据obj 的 环境表 env */
-    lua_getfenv(L, lo);
+    tolua_getpeertable(L, lo);
     
-    if (lua_rawequal(L, -1, TOLUA_NOPEER)) { /* 若环境表为 registry */
+    if (tolua_nopeer(L, -1)) {          /* 若环境表为 registry */
         lua_pop(L, 1);
         
-        /* 新建 表t */
-        lua_newtable(L);
+        /* 新建 表t，声明的字段预先分配在数组部分 */
+        lua_createtable(L, t ? t->slotcount : 0, 0);
         
         /* 将 表t 设置成 用户数据obj 的环境表 */
         lua_pushvalue(L, -1);
-        lua_setfenv(L, lo);
+        tolua_setpeertable(L, lo);
+        if (t)
+            box->flags |= TOLUA_BOX_SLOTPEER;
     };                                  /* stack: obj k v env */
-    
+
+    if (box && (box->flags & TOLUA_BOX_SLOTPEER))
+    {
+        slot = slotindex(L,ctx,box->type,lua_gettop(L)-2);
+        /* 整数键会和数组部分冲突，改成普通的peer表 */
+        if (slot == 0 && lua_type(L,-3) == LUA_TNUMBER)
+            tolua_unslotpeer(L,box,lo);
+    }
+
+    if (slot > 0)
+    {
+        /* env[slot] = v */
+        lua_insert(L, -2);              /* stack: obj k env v */
+        lua_rawseti(L, -2, slot);       /* stack: obj k env */
+        lua_pop(L, 2);
+        return;
+    }
     
     /* 将环境表移到键值对前 */
     lua_insert(L, -3);                  /* stack: obj env k v */
@@ -57,11 +212,10 @@ static void storeatubox (lua_State* L, int lo)
     
     /* 将 环境表env 出栈 */
     lua_pop(L, 1);
-#else                                   /* lua 5.2 */
+#else                                   /* lua 5.0，没有环境表 */
     
     /* 获得 表tolua_peers */
-    lua_pushstring(L,"tolua_peers");
-    lua_rawget(L,LUA_REGISTRYINDEX);    /* stack: obj k v ubox */
+    lua_pushvalue(L,TOLUA_UPV_PEERS);   /* stack: obj k v ubox */
     
     /* 将 用户数据obj 入栈 */
     lua_pushvalue(L,lo);
@@ -108,7 +262,7 @@ static int module_index_event (lua_State* L)
     /*******************/
     
     /* 获取表table[".get"]的值*/
-    lua_pushstring(L,".get");
+    lua_pushvalue(L,TOLUA_UPV_GET);
     lua_rawget(L,-3);                   /* stack : t k get_t:=t[".get"] */
     
     /* 这里是模块内的变量访问的方法 */
@@ -124,6 +278,39 @@ static int module_index_event (lua_State* L)
         else if (lua_istable(L,-1))     /* value是一个表，直接返回该value*/
             return 1;                   /* stack : t k get_t value */
     }
+
+    /*******************************/
+    /* 延迟注册的类和模块，第一次访问时注册 */
+    /*******************************/
+
+    lua_pushvalue(L,TOLUA_UPV_LAZY);
+    lua_rawget(L,1);                    /* stack : t k get_t lazy_t:=t[".lazy"] */
+    if (lua_istable(L,-1))
+    {
+        lua_pushvalue(L,2);
+        lua_rawget(L,-2);               /* stack : t k get_t lazy_t stub:=lazy_t[k] */
+        if (lua_isnumber(L,-1))         /* 类：stub是类型id */
+        {
+            tolua_materialize(L,(int)lua_tonumber(L,-1));
+            lua_pushvalue(L,2);
+            lua_rawget(L,1);
+            return 1;
+        }
+        else if (lua_iscfunction(L,-1)) /* 模块：stub是打开函数 */
+        {
+            /* 先移除stub，打开函数中访问自己时不会再次进入 */
+            lua_pushvalue(L,2);
+            lua_pushnil(L);
+            lua_rawset(L,-4);
+            lua_pushvalue(L,1);
+            lua_call(L,1,0);            /* open(t) */
+            lua_pushvalue(L,2);
+            lua_rawget(L,1);
+            return 1;
+        }
+        lua_pop(L,1);
+    }
+    lua_pop(L,1);                       /* stack : t k get_t */
     
     /************************/
     /* 调用模块元表index元方法 */
@@ -133,7 +320,7 @@ static int module_index_event (lua_State* L)
     if (lua_getmetatable(L,1))          /* stack : t k get_t mt */
     {
         /* 获取__index元方法 */
-        lua_pushstring(L,"__index");
+        lua_pushvalue(L,TOLUA_UPV_INDEX);
         lua_rawget(L,-2);               /* stack : t k get_t idx:=mt.__index */
         
         lua_pushvalue(L,1);
@@ -174,7 +361,7 @@ static int module_newindex_event (lua_State* L)
     /* 调用设置的set函数 */
     /*******************/
     
-    lua_pushstring(L,".set");
+    lua_pushvalue(L,TOLUA_UPV_SET);
     lua_rawget(L,-4);
     
     if (lua_istable(L,-1))              /* stack : t k v set_t:=t[".set"] */
@@ -203,7 +390,7 @@ static int module_newindex_event (lua_State* L)
     {
         /* stack : t k v nil mt:=meta_t mmt:=meta_meta_t */
         
-        lua_pushstring(L,"__newindex");
+        lua_pushvalue(L,TOLUA_UPV_NEWINDEX);
         lua_rawget(L,-2);               /* stack : t k v mt mmt mmt_nidx:=mmt.__newindex */
         if (lua_isfunction(L,-1))       /* mmt_nidx 为函数 */
         {
@@ -223,6 +410,103 @@ static int module_newindex_event (lua_State* L)
     return 0;
 }
 
+/**
+ *  cache[key] = holder，栈不变
+ *
+ *  缓存的是成员所在的表（类表或者.get表），而不是成员本身，
+ *  这样替换已有成员时缓存依旧有效
+ *
+ *  @param L      状态机
+ *  @param cache  缓存表的引用
+ *  @param key    键在栈中的位置
+ *  @param holder 成员所在的表在栈中的位置（false表示整条链上都没有）
+ */
+static void cachekey (lua_State* L, int cache, int key, int holder)
+{
+    if (key < 0)
+        key = lua_gettop(L) + key + 1;
+    if (holder < 0)
+        holder = lua_gettop(L) + holder + 1;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,cache);
+    lua_pushvalue(L,key);
+    lua_pushvalue(L,holder);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+}
+
+/* 键在栈中位置2 */
+#define cachemember(L,cache,holder)     cachekey(L,cache,2,holder)
+
+/**
+ *  前提：栈上有 obj key，栈顶是get函数或者数组的get表
+ *
+ *  get函数：调用get(obj, key)
+ *
+ *  get表：返回代理表，代理表的元表为get表，代理表[".self"] = 对象地址。
+ *  代理表按对象地址缓存在 get表[".proxies"] 中（值弱引用），
+ *  不再为对象创建peer表，同一对象再次读取时不分配内存
+ *
+ *  @param L 状态机
+ *
+ *  @return 1 : 栈顶是返回值
+ */
+static int getmember (lua_State* L)
+{
+    if (lua_iscfunction(L,-1))                  /* value为函数，get函数，则直接调用 */
+    {
+        /* 调用这个函数，参数是obj和key */
+        lua_pushvalue(L,1);
+        lua_pushvalue(L,2);
+        lua_call(L,2,1);
+        return 1;
+    }
+    else                                        /* value是表，get表 */
+    {
+        /* 获得用户数据地址 */
+        void* u = *((void**)lua_touserdata(L,1));
+
+        /* 代理表缓存 proxies:=value[".proxies"] */
+        lua_pushvalue(L,TOLUA_UPV_PROXIES);
+        lua_rawget(L,-2);                       /* stack: obj key ... value proxies */
+        if (!lua_istable(L,-1))
+        {
+            /* 新建 proxies = {__mode = "v"}，自己是自己的元表 */
+            lua_pop(L,1);
+            lua_newtable(L);
+            lua_pushliteral(L,"__mode");
+            lua_pushliteral(L,"v");
+            lua_rawset(L,-3);
+            lua_pushvalue(L,-1);
+            lua_setmetatable(L,-2);
+            lua_pushvalue(L,TOLUA_UPV_PROXIES);
+            lua_pushvalue(L,-2);
+            lua_rawset(L,-4);                   /* value[".proxies"] = proxies */
+        }
+        lua_pushlightuserdata(L,u);
+        lua_rawget(L,-2);                       /* stack: obj key ... value proxies proxies[u] */
+        if (lua_istable(L,-1))
+            return 1;
+        lua_pop(L,1);
+
+        lua_newtable(L);                        /* stack: obj key ... value proxies table */
+        
+        /* table[".self"] = 用户数据地址 */
+        lua_pushvalue(L,TOLUA_UPV_SELF);
+        lua_pushlightuserdata(L,u);
+        lua_rawset(L,-3);
+        
+        /* 设置table的元表为value */
+        lua_pushvalue(L,-3);
+        lua_setmetatable(L,-2);
+
+        /* proxies[u] = table */
+        lua_pushlightuserdata(L,u);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,-4);
+        return 1;
+    }
+}
+
 /**
  *  Class index function
  *
@@ -245,52 +529,116 @@ static int class_index_event (lua_State* L)
     int t = lua_type(L,1);
     if (t == LUA_TUSERDATA)                         /* 若是用户数据 */
     {
+        tolua_Context* ctx = (tolua_Context*)lua_touserdata(L,TOLUA_UPV_CTX);
+        tolua_Box* box = tolua_tobox(L,1);
+        tolua_Type* type = NULL;
+
         /* Access alternative table */
         
         /*****************************/
         /* 先是查找用户数据对象的成员变量 */
         /*****************************/
         
-#ifdef LUA_VERSION_NUM                              /* 对于 lua5.1 */
-        /* 获得 用户数据 的 环境表env，并压入栈中 */
-        lua_getfenv(L,1);
+        /* 从没有设置过peer的对象直接跳过 */
+        if (box == NULL || (box->flags & TOLUA_BOX_HASPEER))
+        {
+#ifdef LUA_VERSION_NUM                              /* lua5.1以上，环境表或uservalue */
+            /* 获得 用户数据 的 环境表env，并压入栈中 */
+            tolua_getpeertable(L,1);
         
-        if (!lua_rawequal(L, -1, TOLUA_NOPEER)) {   /* 表env 不是reg，则为自定义环境表 */
-            /* 将栈中的键入栈 */
-            lua_pushvalue(L, 2);                    /* stack: obj key env key */
-            /* 在表env中查找 */
-            /* 即env[key] */
-            /* on lua 5.1, we trade the "tolua_peers" lookup for a gettable call */
-            lua_gettable(L, -2);                    /* stack: obj key env[key] */
-            if (!lua_isnil(L, -1))                  /* 若不为空则返回 1 */
-                return 1;
-        };
-#else                                               /* lua 5.2 */
-        /* 直接入栈 reg.tolua_peers */
-        lua_pushstring(L,"tolua_peers");
-        lua_rawget(L,LUA_REGISTRYINDEX);            /* stack: obj key peer */
+            if (!tolua_nopeer(L, -1)) {                 /* 表env 不是reg，则为自定义环境表 */
+                int slotpeer = box && (box->flags & TOLUA_BOX_SLOTPEER);
+                int slot = slotpeer ? slotindex(L, ctx, box->type, 2) : 0;
+                if (slot > 0)                           /* 声明的字段在数组部分 */
+                    lua_rawgeti(L, -1, slot);           /* stack: obj key env env[slot] */
+                else if (slotpeer && lua_type(L, 2) == LUA_TNUMBER)
+                    lua_pushnil(L);                     /* 数组部分只有声明的字段 */
+                else
+                {
+                    /* 将栈中的键入栈 */
+                    lua_pushvalue(L, 2);                /* stack: obj key env key */
+                    /* 在表env中查找 */
+                    /* 即env[key] */
+                    /* on lua 5.1, we trade the "tolua_peers" lookup for a gettable call */
+                    lua_gettable(L, -2);                /* stack: obj key env[key] */
+                }
+                if (!lua_isnil(L, -1))                  /* 若不为空则返回 1 */
+                    return 1;
+            };
+#else                                               /* lua 5.0，没有环境表 */
+            /* 直接入栈 reg.tolua_peers */
+            lua_pushvalue(L,TOLUA_UPV_PEERS);           /* stack: obj key peer */
         
-        lua_pushvalue(L,1);                         /* stack: obj key peer obj */
-        /* 获得对象对应的 环境表env */
-        lua_rawget(L,-2);                           /* stack: obj key peer env:=peer[obj] */
+            lua_pushvalue(L,1);                         /* stack: obj key peer obj */
+            /* 获得对象对应的 环境表env */
+            lua_rawget(L,-2);                           /* stack: obj key peer env:=peer[obj] */
         
-        if (lua_istable(L,-1))
+            if (lua_istable(L,-1))
+            {
+                lua_pushvalue(L,2);                     /* stack: obj key peer env key */
+                /* 在 环境表env 中查询 */
+                lua_rawget(L,-2);                       /* stack: obj key peer env value */
+                if (!lua_isnil(L,-1))
+                    return 1;
+            }
+#endif
+        }
+        
+        /* 重置栈顶 */
+        lua_settop(L,2);                            /* stack: obj key */
+
+        /*****************************/
+        /* 查找类的展平缓存，命中则不用遍历元表链 */
+        /*****************************/
+
+        if (box && !lua_isnumber(L,2))
         {
-            lua_pushvalue(L,2);                     /* stack: obj key peer env key */
-            /* 在 环境表env 中查询 */
-            lua_rawget(L,-2);                       /* stack: obj key peer env value */
-            if (!lua_isnil(L,-1))
-                return 1;
+            type = tolua_membercache(L,ctx,box->type);
+            lua_rawgeti(L,LUA_REGISTRYINDEX,type->mcache);
+            lua_pushvalue(L,2);
+            lua_rawget(L,-2);                       /* stack: obj key mcache mt */
+            if (lua_istable(L,-1))
+            {
+                lua_pushvalue(L,2);
+                lua_rawget(L,-2);                   /* stack: obj key mcache mt value */
+                if (!lua_isnil(L,-1))
+                    return 1;
+            }
+            lua_settop(L,2);
+            lua_rawgeti(L,LUA_REGISTRYINDEX,type->gcache);
+            lua_pushvalue(L,2);
+            lua_rawget(L,-2);                       /* stack: obj key gcache tget */
+            if (lua_istable(L,-1))
+            {
+                lua_pushvalue(L,2);
+                lua_rawget(L,-2);                   /* stack: obj key gcache tget value */
+                if (lua_iscfunction(L,-1) || lua_istable(L,-1))
+                    return getmember(L);
+            }
+            /* 成员已经被删除，重新查找 */
+            lua_settop(L,2);                        /* stack: obj key */
+        }
+        else if (box)
+        {
+            /* 数组协议，范围内直接读元素 */
+            const tolua_ArrayDef* def = tolua_arraydef(ctx,box->type);
+            if (def)
+            {
+                int i = (int)lua_tonumber(L,2);
+                if (box->flags & TOLUA_BOX_DEAD)
+                    return tolua_deaderror(L,box);
+                if (i >= 0 && i < def->length(box->ptr))
+                {
+                    tolua_pushelem(L,def,tolua_arraydata(def,box->ptr),i);
+                    return 1;
+                }
+            }
         }
-#endif
         
         /***************************/
         /* 然后是查找用户函数的get函数 */
         /***************************/
         
-        /* 重置栈顶 */
-        lua_settop(L,2);                            /* stack: obj key */
-        
         /* 将 用户数据obj 入栈 */
         lua_pushvalue(L,1);                         /* stack: obj key obj */
         while (lua_getmetatable(L,-1))              /* stack: obj key obj mt */
@@ -301,7 +649,7 @@ static int class_index_event (lua_State* L)
             {
                 /* 访问 元表mt 中的 ".geti" 字段 */
                 /* mt[".geti"] */
-                lua_pushstring(L,".geti");
+                lua_pushvalue(L,TOLUA_UPV_GETI);
                 lua_rawget(L,-2);                   /* stack: obj key mt func:=mt[".geti"] */
                 
                 if (lua_isfunction(L,-1))
@@ -319,50 +667,26 @@ static int class_index_event (lua_State* L)
                 lua_rawget(L,-2);                   /* stack: obj key mt value */
                 
                 if (!lua_isnil(L,-1))               /* 检查value，若是有效值则返回 */
+                {
+                    if (type)                       /* mcache[key] = mt */
+                        cachemember(L,type->mcache,-2);
                     return 1;
+                }
                 else                                /* 若是nil，则将这个nil出栈 */
                     lua_pop(L,1);
                 
                 /* 元表mt 中的 ".get" 字段 */
-                lua_pushstring(L,".get");
+                lua_pushvalue(L,TOLUA_UPV_GET);
                 lua_rawget(L,-2);                   /* stack: obj key mt tget:=mt[".get"] */
                 if (lua_istable(L,-1))              /* tget是表 */
                 {
                     lua_pushvalue(L,2);
                     lua_rawget(L,-2);               /* stack: obj key mt tget value:=tget[key] */
-                    if (lua_iscfunction(L,-1))      /* value为函数，get函数，则直接调用 */
+                    if (lua_iscfunction(L,-1) || lua_istable(L,-1))
                     {
-                        /* 调用这个函数，参数是obj和key */
-                        lua_pushvalue(L,1);
-                        lua_pushvalue(L,2);
-                        lua_call(L,2,1);
-                        return 1;
-                    }
-                    else if (lua_istable(L,-1))      /* value是表，get表 */
-                    {
-                        /* 获得用户数据地址 */
-                        void* u = *((void**)lua_touserdata(L,1));
-                        lua_newtable(L);             /* stack: obj key mt tget value table */
-                        
-                        
-                        /* table[".self"] = 用户数据地址 */
-                        lua_pushstring(L,".self");
-                        lua_pushlightuserdata(L,u);
-                        lua_rawset(L,-3);
-                        
-                        /* 交换 table 和 value 的位置 */
-                        lua_insert(L,-2);            /* stack: obj key mt tget table value */
-                        /* 设置table的元表为value */
-                        lua_setmetatable(L,-2);
-                        /* 拷贝一份至栈顶 */
-                        lua_pushvalue(L,-1);         /* stack: obj key mt tget table table */
-                        lua_pushvalue(L,2);          /* stack: obj key mt tget table table key */
-                        lua_insert(L,-2);            /* stack: obj key mt tget table key table */
-                        
-                        
-                        /* obj.env[key] = table */
-                        storeatubox(L,1);            /* stack: obj key mt tget table */
-                        return 1;
+                        if (type)                   /* gcache[key] = tget */
+                            cachemember(L,type->gcache,-2);
+                        return getmember(L);
                     }
                 }
             }
@@ -370,6 +694,7 @@ static int class_index_event (lua_State* L)
             lua_settop(L,3);
         }
         /* 查询完所有的元表之后还没找到，则返回nil */
+        /* 不缓存找不到的键：rawset到类表中的方法无法通知缓存 */
         lua_pushnil(L);
         return 1;
     }
@@ -386,6 +711,36 @@ static int class_index_event (lua_State* L)
 }
 
 
+/**
+ *  前提：栈上有 obj k v，且没有找到k的set函数
+ *
+ *  密封的类报错：声明了字段的类设置的不是声明的字段，或者对象没有peer。
+ *  否则存入对象的peer中
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param box  对象的数据块，不是tolua的用户数据时为NULL
+ *
+ *  @return 0
+ */
+static int storefield (lua_State* L, tolua_Context* ctx, tolua_Box* box)
+{
+    if (box)
+    {
+        tolua_Type* type = &ctx->types[tolua_typeindex(box->type)];
+        /* 声明了字段的类，有peer之后依旧只能设置声明的字段 */
+        if (type->sealed && (tolua_slotpolicy(ctx,box->type) ? !slotindex(L,ctx,box->type,2)
+                                                              : !(box->flags & TOLUA_BOX_HASPEER)))
+            luaL_error(L,"cannot set field '%s' of sealed class '%s'",
+                       lua_isstring(L,2) ? lua_tostring(L,2) : luaL_typename(L,2),type->name);
+    }
+
+    /* then, store as a new field */
+    /* 新建一个设置函数 */
+    storeatubox(L,ctx,box,1);
+    return 0;
+}
+
 /**
  *  Newindex function
  *
@@ -404,6 +759,55 @@ static int class_newindex_event (lua_State* L)
     int t = lua_type(L,1);
     if (t == LUA_TUSERDATA)                     /* 若是用户数据 */
     {
+        tolua_Context* ctx = (tolua_Context*)lua_touserdata(L,TOLUA_UPV_CTX);
+        tolua_Box* box = tolua_tobox(L,1);
+        tolua_Type* type = NULL;
+
+        /* 数组协议，范围内直接写元素 */
+        if (box && lua_isnumber(L,2))
+        {
+            const tolua_ArrayDef* def = !(box->type & TOLUA_TYPE_CONST) ?
+                tolua_arraydef(ctx,box->type) : NULL;
+            if (def)
+            {
+                int i = (int)lua_tonumber(L,2);
+                if (box->flags & TOLUA_BOX_DEAD)
+                    return tolua_deaderror(L,box);
+                if (i >= 0 && i < def->length(box->ptr))
+                {
+                    tolua_setelem(L,def,tolua_arraydata(def,box->ptr),i,3);
+                    return 0;
+                }
+            }
+        }
+        else if (box)
+        {
+            /* 展平的set函数缓存，scache[k]为set函数所在的.set表，false表示没有 */
+            type = tolua_membercache(L,ctx,box->type);
+            lua_rawgeti(L,LUA_REGISTRYINDEX,type->scache);
+            lua_pushvalue(L,2);
+            lua_rawget(L,-2);                   /* stack: obj k v scache tset */
+            if (lua_istable(L,-1))
+            {
+                lua_pushvalue(L,2);
+                lua_rawget(L,-2);               /* stack: obj k v scache tset func */
+                if (lua_iscfunction(L,-1))
+                {
+                    lua_pushvalue(L,1);
+                    lua_pushvalue(L,3);
+                    lua_call(L,2,0);
+                    return 0;
+                }
+            }
+            else if (lua_isboolean(L,-1))       /* 整条链上都没有set函数 */
+            {
+                lua_settop(L,3);
+                return storefield(L,ctx,box);
+            }
+            /* set函数已经被删除，重新查找 */
+            lua_settop(L,3);                    /* stack: obj k v */
+        }
+
         /* Try accessing a C/C++ variable to be set */
         
         /* 获得 用户数据obj 的 元表mt */
@@ -413,7 +817,7 @@ static int class_newindex_event (lua_State* L)
             if (lua_isnumber(L,2))              /* 键是否为 数字 */
             {
                 /* 在 元表mt 中查询，获得set函数 */
-                lua_pushstring(L,".seti");
+                lua_pushvalue(L,TOLUA_UPV_SETI);
                 lua_rawget(L,-2);               /* stack: obj k v mt func:=mt[".seti"] */
                 if (lua_isfunction(L,-1))
                 {
@@ -428,7 +832,7 @@ static int class_newindex_event (lua_State* L)
             {
                 /* 获得 mt[".set"] */
                 /* 获得 表tset */
-                lua_pushstring(L,".set");
+                lua_pushvalue(L,TOLUA_UPV_SET);
                 lua_rawget(L,-2);               /* stack: obj k v mt tset:=mt[".set"] */
                 if (lua_istable(L,-1))
                 {
@@ -437,6 +841,8 @@ static int class_newindex_event (lua_State* L)
                     lua_rawget(L,-2);           /* stack: obj k v mt tset func:=tset[k] */
                     if (lua_iscfunction(L,-1))
                     {
+                        if (type)               /* scache[k] = tset */
+                            cachemember(L,type->scache,-2);
                         lua_pushvalue(L,1);
                         lua_pushvalue(L,3);
                         lua_call(L,2,0);
@@ -458,13 +864,35 @@ static int class_newindex_event (lua_State* L)
         
         /* 若没有找到set函数 */
         lua_settop(L,3);                        /* stack: obj k v */
+        /* 只记字符串键：表、函数等做键会被缓存一直引用；数量有上限 */
+        if (type && lua_type(L,2) == LUA_TSTRING && type->nmiss < TOLUA_MAXMISS)
+        {
+            lua_pushboolean(L,0);               /* scache[k] = false */
+            cachemember(L,type->scache,-1);
+            lua_pop(L,1);
+            type->nmiss++;
+        }
 
         /* then, store as a new field */
-        /* 新建一个设置函数 */
-        storeatubox(L,1);
+        return storefield(L,ctx,box);
     }
     else if (t== LUA_TTABLE)                    /* 模块表 */
     {
+        /* 类表中加入了成员，成员缓存失效 */
+        tolua_touchmembers(L,(tolua_Context*)lua_touserdata(L,TOLUA_UPV_CTX),1);
+
+        /* 在类表中设置运算函数，直接存入并绑定元方法；其它以'.'开头的键照常经过.set查找 */
+        if (lua_type(L,2) == LUA_TSTRING && operatorindex(lua_tostring(L,2)) >= 0)
+        {
+            lua_settop(L,3);
+            lua_pushvalue(L,2);
+            lua_pushvalue(L,3);
+            lua_rawset(L,1);
+            lua_pushvalue(L,1);
+            tolua_bindoperator(L,lua_tostring(L,2));
+            return 0;
+        }
+
         /* stack : table key value */
         module_newindex_event(L);
     }
@@ -482,7 +910,7 @@ static int class_newindex_event (lua_State* L)
 static int class_call_event(lua_State* L) {
 
     if (lua_istable(L, 1)) {
-        lua_pushstring(L, ".call");
+        lua_pushvalue(L, TOLUA_UPV_OP);
         lua_rawget(L, 1);
         if (lua_isfunction(L, -1)) {
 
@@ -497,117 +925,129 @@ static int class_call_event(lua_State* L) {
 };
 
 /**
- *  前提：栈中含有两个对象以供操作op1，op2
+ *  前提：栈中位置1是用户数据
  *
- *  直接查找第一个对象的元表中的元方法
+ *  从第一个操作数的类开始沿元表链查找运算函数（键为TOLUA_UPV_OP），
+ *  结果记在类的成员缓存中，之后不再遍历元表链
  *
- *  @param L  状态机
- *  @param op 操作
+ *  @param L 状态机
  *
- *  @return 1 : 成功
- *  @return 0 : 出错
+ *  @return 1 : 找到，函数在栈顶
+ *  @return 0 : 没有找到，栈不变
  */
-static int do_operator (lua_State* L, const char* op)
+static int findoperator (lua_State* L)
 {
-    if (lua_isuserdata(L,1))                    /* 要保证第一个参数为用户数据 */
+    tolua_Context* ctx = (tolua_Context*)lua_touserdata(L,TOLUA_UPV_OPCTX);
+    tolua_Box* box = tolua_tobox(L,1);
+    tolua_Type* type = NULL;
+    int top = lua_gettop(L);
+
+    if (box)
     {
-        lua_pushvalue(L,1);                     /* stack: op1       op2 op1 */
-        while (lua_getmetatable(L,-1))          /* stack: op1       op2 op1 mt */
+        type = tolua_membercache(L,ctx,box->type);
+        lua_rawgeti(L,LUA_REGISTRYINDEX,type->mcache);
+        lua_pushvalue(L,TOLUA_UPV_OP);
+        lua_rawget(L,-2);                       /* stack: ... mcache mt */
+        if (lua_istable(L,-1))
         {
-            lua_remove(L,-2);                   /* stack: op1       op2 mt */
-            lua_pushstring(L,op);               /* stack: op1       op2 mt key:=op2 */
-            lua_rawget(L,-2);                   /* stack: obj:=op1  key mt func:=mt.key */
+            lua_pushvalue(L,TOLUA_UPV_OP);
+            lua_rawget(L,-2);                   /* stack: ... mcache mt func */
             if (lua_isfunction(L,-1))
             {
-                lua_pushvalue(L,1);
-                lua_pushvalue(L,2);
-                lua_call(L,2,1);
+                lua_replace(L,top+1);
+                lua_settop(L,top+1);
                 return 1;
             }
-            lua_settop(L,3);
         }
+        lua_settop(L,top);
     }
-    /* 错误调用，返回出错信息 */
-    tolua_error(L,"Attempt to perform operation on an invalid operand",NULL);
-    return 0;
-}
 
-/**
- *  add方法
- *
- *  @param L 状态机
- *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
- */
-static int class_add_event (lua_State* L)
-{
-    return do_operator(L,".add");
-}
-
-/**
- *  sub方法
- *
- *  @param L 状态机
- *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
- */
-int class_sub_event (lua_State* L)
-{
-    return do_operator(L,".sub");
+    lua_pushvalue(L,1);                         /* stack: ... op1 */
+    while (lua_getmetatable(L,-1))              /* stack: ... op1 mt */
+    {
+        lua_remove(L,-2);                       /* stack: ... mt */
+        lua_pushvalue(L,TOLUA_UPV_OP);
+        lua_rawget(L,-2);                       /* stack: ... mt func:=mt.key */
+        if (lua_isfunction(L,-1))
+        {
+            if (type)                           /* mcache[key] = mt */
+            {
+                lua_pushvalue(L,TOLUA_UPV_OP);
+                cachekey(L,type->mcache,-1,-3);
+                lua_pop(L,1);
+            }
+            lua_replace(L,top+1);
+            lua_settop(L,top+1);
+            return 1;
+        }
+        lua_pop(L,1);
+    }
+    lua_settop(L,top);
+    return 0;
 }
 
 /**
- *  mul方法
+ *  运算方法
  *
- *  @param L 状态机
+ *  前提：栈中含有两个对象以供操作op1，op2
  *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
- */
-static int class_mul_event (lua_State* L)
-{
-    return do_operator(L,".mul");
-}
-
-/**
- *  div方法
+ *  沿第一个对象的元表链查找运算函数，键(如".add")为闭包的upvalue。
+ *  找到后直接设置为第一个对象所属类的元方法（如__add），
+ *  之后同一个类的运算由lua直接调用该函数，不再经过这里
  *
- *  @param L 状态机
+ *  @param L  状态机
  *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
+ *  @return 1 : 成功
+ *  @return 0 : 出错
  */
-static int class_div_event (lua_State* L)
+static int class_operator_event (lua_State* L)
 {
-    return do_operator(L,".div");
+    lua_settop(L,2);
+    if (lua_isuserdata(L,1) && findoperator(L))  /* stack: op1 op2 func */
+    {
+        /* mt1.__add = func，只改tolua对象的元表 */
+        if (tolua_tobox(L,1) && lua_getmetatable(L,1))
+        {
+            lua_pushvalue(L,TOLUA_UPV_EVENT);
+            lua_pushvalue(L,3);
+            lua_rawset(L,-3);
+            lua_pop(L,1);
+        }
+        lua_pushvalue(L,1);
+        lua_pushvalue(L,2);
+        lua_call(L,2,1);
+        return 1;
+    }
+    /* 错误调用，返回出错信息 */
+    tolua_error(L,"Attempt to perform operation on an invalid operand",NULL);
+    return 0;
 }
 
 /**
- *  lt方法
+ *  比较方法
  *
- *  @param L 状态机
+ *  lua要求两个操作数的__lt、__le是同一个函数才会调用，
+ *  所以比较元方法不能像运算一样换成各个类自己的函数，只能共用这个闭包，
+ *  运算函数通过成员缓存查找
  *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
- */
-static int class_lt_event (lua_State* L)
-{
-    return do_operator(L,".lt");
-}
-
-/**
- *  le方法
- *
- *  @param L 状态机
+ *  @param L  状态机
  *
- *  @return 1 : 正确调用
- *  @return 0 : 错误调用
+ *  @return 1 : 成功
+ *  @return 0 : 出错
  */
-static int class_le_event (lua_State* L)
+static int class_compare_event (lua_State* L)
 {
-    return do_operator(L,".le");
+    lua_settop(L,2);
+    if (lua_isuserdata(L,1) && findoperator(L))  /* stack: op1 op2 func */
+    {
+        lua_pushvalue(L,1);
+        lua_pushvalue(L,2);
+        lua_call(L,2,1);
+        return 1;
+    }
+    /* 错误调用，返回出错信息 */
+    tolua_error(L,"Attempt to perform operation on an invalid operand",NULL);
+    return 0;
 }
 
 /**
@@ -620,25 +1060,15 @@ static int class_le_event (lua_State* L)
  */
 static int class_eq_event (lua_State* L)
 {
-    if (lua_isuserdata(L,1))
+    lua_settop(L,2);
+    if (lua_isuserdata(L,1) && findoperator(L)) /* stack: op1 op2 func */
     {
-        lua_pushvalue(L,1);             /* stack: op1       op2         op1              */
-        while (lua_getmetatable(L,-1))  /* stack: op1       op2         op1 mt           */
-        {
-            lua_remove(L,-2);           /* stack: op1       op2         mt               */
-            lua_pushstring(L,".eq");    /* stack: op1       op2         mt  str:=".eq"   */
-            lua_rawget(L,-2);           /* stack: obj:=op1  key:=op2    mt  func:=mt.str */
-            if (lua_isfunction(L,-1))
-            {
-                lua_pushvalue(L,1);
-                lua_pushvalue(L,2);
-                /* 调用函数 func(obj, key) */
-                lua_call(L,2,1);
-                return 1;
-            }
-            lua_settop(L,3);
-        }
-    }                                   /* 到此为止都和 do_operator 一样 */
+        lua_pushvalue(L,1);
+        lua_pushvalue(L,2);
+        /* 调用函数 func(op1, op2) */
+        lua_call(L,2,1);
+        return 1;
+    }
     
     /* 对于等于比较永远不会出错，成功调用，入栈0 */
     lua_settop(L, 3);
@@ -673,64 +1103,261 @@ static int class_gc_event (lua_State* L)
  *
  *  当需要垃圾回收的时候，第一个参数是用户数据obj
  *
+ *  所有权和回收函数记在数据块中，没有所有权的对象只做一次判断就返回
+ *
+ *  upvalue是".collector"
+ *
  *  @param L 状态机
  *
- *  @return 1 : 成功调用
- *  @return 0 : 失败调用
+ *  @return 0
  */
 TOLUA_API int class_gc_event (lua_State* L)
 {
-    void* u = *((void**)lua_touserdata(L,1));
-    int top;
-    
-    /*fprintf(stderr, "collecting: looking at %p\n", u);*/
-    /*
-    lua_pushstring(L,"tolua_gc");
-    lua_rawget(L,LUA_REGISTRYINDEX);
-    */
-    
-    /* 获取第一个upvalue，reg.tolua_gc */
-    lua_pushvalue(L, lua_upvalueindex(1));  /* stack: gc:=reg.tolua_gc    */
-    lua_pushlightuserdata(L,u);             /* stack: gc u                */
-    lua_rawget(L,-2);                       /* stack: gc umt:=gc[u]       */
-    lua_getmetatable(L,1);                  /* stack: gc umt mt:=meta_obj */
-    
-    /*fprintf(stderr, "checking type\n");*/
-    
-    top = lua_gettop(L);
-    
-    /* 检查mt和umt是否是同一个对象 */
-    /* 获取第二个upvalue，reg.tolua_super */
-    if (tolua_fast_isa(L,top,top-1, lua_upvalueindex(2)))
+    tolua_Box* box = tolua_tobox(L,1);
+    lua_CFunction col;
+
+    if (box == NULL)
+        return 0;
+    /* 等待__gc时c对象被tolua_invalidate过，数据块在这里失效 */
+    if (tolua_context(L)->ntombs > 0)
+        tolua_reaptomb(tolua_context(L),box);
+    /* 从对象表中删除 */
+    if (box->slot)
+        tolua_unmapbox(tolua_context(L),box);
+    /* 回收之后对象的原生内存不再由lua负责 */
+    tolua_unchargebox(tolua_context(L),box);
+    /* 引用计数策略：release，按回收方式可以延迟 */
+    if (box->flags & TOLUA_BOX_RETAINED)
     {
-        /*fprintf(stderr, "Found type!\n");*/
-        
-        lua_pushliteral(L,".collector");
-        /* 获取垃圾回收函数col */
-        lua_rawget(L,-2);                   /* stack: gc umt mt col:=mt[".collector"] */
-        if (lua_isfunction(L,-1)) {         /* 含有col函数 */
-            /*fprintf(stderr, "Found .collector!\n");*/
-        } else {                            /* 否则入栈默认垃圾回收函数 */
+        tolua_Context* ctx = tolua_context(L);
+        tolua_Type* ref = tolua_refpolicy(ctx,box->type);
+        box->flags &= ~TOLUA_BOX_RETAINED;
+        if (ref && ref->release && !tolua_defercollect(ctx,box,NULL,ref->release))
+            ref->release(box->ptr);
+    }
+    if (!(box->flags & TOLUA_BOX_OWNED))
+        return 0;
+    box->flags &= ~TOLUA_BOX_OWNED;
+
+    col = box->col;
+    if (col == NULL)                        /* .collector是lua函数，不能保存在c端 */
+    {
+        lua_getmetatable(L,1);
+        lua_pushvalue(L,lua_upvalueindex(1));
+        lua_rawget(L,-2);                   /* stack: u mt col:=mt[".collector"] */
+        if (!lua_isfunction(L,-1))
+        {
             lua_pop(L,1);
-            /*fprintf(stderr, "Using default cleanup\n");*/
             lua_pushcfunction(L,tolua_default_collect);
         }
-
-        lua_pushvalue(L,1);                 /* stack: gc umt mt col u */
-        /* 执行垃圾回收函数 */
+        lua_pushvalue(L,1);
         lua_call(L,1,0);
+        lua_pop(L,1);
+        return 0;
+    }
 
-        /* 表tolua_gc 中 删除对应 */
-        lua_pushlightuserdata(L,u);         /* stack: gc umt mt u */
-        lua_pushnil(L);                     /* stack: gc umt mt u nil */
-        lua_rawset(L,-5);                   /* stack: gc umt mt */
+    /* 延迟回收的类放入队列，否则立即执行垃圾回收函数 */
+    if (!tolua_defercollect(tolua_context(L),box,col,NULL))
+    {
+        lua_pushcfunction(L,col);
+        lua_pushvalue(L,1);
+        lua_call(L,1,0);
     }
-    
-    /* 清除栈 */
-    lua_pop(L,3);
     return 0;
 }
 
+/**
+ *  将事件闭包的upvalue入栈
+ *
+ *  @param L 状态机
+ */
+static void pushkeys (lua_State* L)
+{
+    lua_pushliteral(L,".get");
+    lua_pushliteral(L,".set");
+    lua_pushliteral(L,".geti");
+    lua_pushliteral(L,".seti");
+    lua_pushliteral(L,".self");
+    lua_pushliteral(L,"__index");
+    lua_pushliteral(L,"__newindex");
+#ifdef LUA_VERSION_NUM                  /* lua 5.1以上使用环境表或uservalue，不需要tolua_peers */
+    lua_pushnil(L);
+#else
+    lua_pushstring(L,"tolua_peers");
+    lua_rawget(L,LUA_REGISTRYINDEX);
+#endif
+    lua_pushliteral(L,".lazy");
+    lua_pushlightuserdata(L,tolua_context(L));
+    lua_pushliteral(L,".proxies");
+}
+
+/**
+ *  前提：栈顶有表
+ *
+ *  t[name] = closure(func, 预先内部化的键)
+ *
+ *  @param L    状态机
+ *  @param name 元方法名
+ *  @param func 事件函数
+ */
+static void setevent (lua_State* L, const char* name, lua_CFunction func)
+{
+    lua_pushstring(L,name);
+    pushkeys(L);
+    lua_pushcclosure(L,func,TOLUA_NUPV);
+    lua_rawset(L,-3);
+}
+
+/**
+ *  前提：栈顶有表
+ *
+ *  t[name] = closure(func, key)
+ *
+ *  @param L    状态机
+ *  @param name 元方法名
+ *  @param key  在类元表中查找的键
+ *  @param func 事件函数
+ */
+static void setkeyevent (lua_State* L, const char* name, const char* key, lua_CFunction func)
+{
+    lua_pushstring(L,name);
+    lua_pushstring(L,key);
+    lua_pushstring(L,name);
+    lua_pushlightuserdata(L,tolua_context(L));
+    lua_pushcclosure(L,func,TOLUA_NOPUV);
+    lua_rawset(L,-3);
+}
+
+/**
+ *  前提：栈顶是运算函数f（可以为nil）
+ *
+ *  类型id及其子类（元表沿主基类链接）的元方法设为f，值类型对象的元表也一样。
+ *  自己定义了这个运算函数的子类连同它的子类都不受影响，只访问id下面的子类
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ *  @param id  类型id
+ *  @param op  tolua_operators中的下标
+ */
+static void spreadoperator (lua_State* L, tolua_Context* ctx, int id, int op)
+{
+    int sub;
+    if (ctx->types[id].vmt != LUA_NOREF)
+    {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[id].vmt);   /* stack: f vmt */
+        lua_pushstring(L,tolua_operators[op].event);
+        lua_pushvalue(L,-3);
+        lua_rawset(L,-3);
+        lua_pop(L,1);                       /* stack: f */
+    }
+    lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[id].mt);        /* stack: f mt */
+    lua_pushstring(L,tolua_operators[op].event);
+    lua_pushvalue(L,-3);
+    lua_rawset(L,-3);
+    lua_pop(L,1);                           /* stack: f */
+
+    for (sub=ctx->types[id].firstsub; sub>=0; sub=ctx->types[sub].nextsub)
+    {
+        int own;
+        if (ctx->types[sub].mt == LUA_NOREF)
+            continue;                       /* 注册时再从基类继承 */
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[sub].mt);
+        lua_pushstring(L,tolua_operators[op].key);
+        lua_rawget(L,-2);                   /* stack: f smt smt[key] */
+        own = !lua_isnil(L,-1);
+        lua_pop(L,2);                       /* stack: f */
+        if (!own)
+            spreadoperator(L,ctx,sub,op);
+    }
+}
+
+/**
+ *  前提：栈顶是类型id的类表mt
+ *
+ *  重新解析一个运算元方法：类表自己的运算函数，没有则继承基类元表上解析好的元方法，
+ *  都没有时是共用的查找闭包（shared）或者nil，然后传给子类
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ *  @param id  类型id
+ *  @param op  tolua_operators中的下标
+ */
+static void bindoperator (lua_State* L, tolua_Context* ctx, int id, int op)
+{
+    lua_pushstring(L,tolua_operators[op].key);
+    lua_rawget(L,-2);                       /* stack: mt f:=mt[key] */
+    if (lua_isnil(L,-1) && lua_getmetatable(L,-2))
+    {
+        lua_pushstring(L,tolua_operators[op].event);
+        lua_rawget(L,-2);                   /* stack: mt nil bmt bmt[event] */
+        lua_replace(L,-3);
+        lua_pop(L,1);                       /* stack: mt f */
+    }
+    if (lua_isnil(L,-1) && tolua_operators[op].shared)
+    {
+        lua_pop(L,1);
+        lua_pushstring(L,"tolua_classevents");
+        lua_rawget(L,LUA_REGISTRYINDEX);    /* stack: mt events */
+        if (lua_istable(L,-1))
+        {
+            lua_pushstring(L,tolua_operators[op].event);
+            lua_rawget(L,-2);
+            lua_remove(L,-2);               /* stack: mt closure */
+        }
+        else                                /* tolua_open之前 */
+        {
+            lua_pop(L,1);
+            lua_pushnil(L);
+        }
+    }
+    spreadoperator(L,ctx,id,op);
+    lua_pop(L,1);                           /* stack: mt */
+}
+
+/**
+ *  前提：栈顶是类表，类表中刚设置了key
+ *
+ *  key是运算函数（如".add"）时，直接把它设为这个类的元方法（如__add），
+ *  没有自己的运算函数的子类也直接设为它，运算时lua直接调用，不再查找元表链。
+ *  设为nil时恢复成基类的元方法。
+ *  只访问这个类下面的子类，注册N个类的运算函数不需要每次遍历所有类型
+ *
+ *  @param L   状态机
+ *  @param key 类表中的键
+ */
+TOLUA_API void tolua_bindoperator (lua_State* L, const char* key)
+{
+    tolua_Context* ctx;
+    int i = operatorindex(key), id;
+    if (i < 0 || (id = tolua_mttype(L,-1)) < 0)
+        return;                             /* 不是运算函数，或者不是类表 */
+    ctx = tolua_context(L);
+    id = tolua_typeindex(id);
+    if (ctx->types[id].mt != LUA_NOREF)
+        bindoperator(L,ctx,id,i);
+}
+
+/**
+ *  前提：栈顶是类表
+ *
+ *  类表链接到基类（或者值类型的元表刚创建）之后调用，按基类重新解析所有运算元方法
+ *
+ *  @param L 状态机
+ */
+TOLUA_API void tolua_inheritoperators (lua_State* L)
+{
+    tolua_Context* ctx;
+    int i, id;
+    if ((id = tolua_mttype(L,-1)) < 0)
+        return;
+    ctx = tolua_context(L);
+    id = tolua_typeindex(id);
+    if (ctx->types[id].mt == LUA_NOREF)
+        return;
+    for (i=0; tolua_operators[i].key; ++i)
+        bindoperator(L,ctx,id,i);
+}
+
 /**
  *  Register module events
  *
@@ -744,13 +1371,8 @@ TOLUA_API int class_gc_event (lua_State* L)
  */
 TOLUA_API void tolua_moduleevents (lua_State* L)
 {
-    lua_pushstring(L,"__index");
-    lua_pushcfunction(L,module_index_event);
-    lua_rawset(L,-3);
-    
-    lua_pushstring(L,"__newindex");
-    lua_pushcfunction(L,module_newindex_event);
-    lua_rawset(L,-3);
+    setevent(L,"__index",module_index_event);
+    setevent(L,"__newindex",module_newindex_event);
 }
 
 /**
@@ -789,68 +1411,72 @@ TOLUA_API int tolua_ismodulemetatable (lua_State* L)
  *
  *  将c函数绑定到各个元方法
  *
+ *  所有类共用同一组事件闭包，第一次调用时创建并保存在reg.tolua_classevents中
+ *
  *  @param L 状态机
  */
 TOLUA_API void tolua_classevents (lua_State* L)
 {
-    /**************/
-    /* 添加查询函数 */
-    /**************/
-    
-    /* 绑定到__index */
-    lua_pushstring(L,"__index");
-    lua_pushcfunction(L,class_index_event);
-    lua_rawset(L,-3);
-    /* 绑定到__newindex */
-    lua_pushstring(L,"__newindex");
-    lua_pushcfunction(L,class_newindex_event);
-    lua_rawset(L,-3);
+    int i;
+    lua_pushstring(L,"tolua_classevents");
+    lua_rawget(L,LUA_REGISTRYINDEX);        /* stack: mt events */
+    if (!lua_istable(L,-1))
+    {
+        lua_pop(L,1);
+        lua_newtable(L);                    /* stack: mt events */
 
-    
-    /***********/
-    /* 运算函数 */
-    /***********/
-    
-    /* 绑定到__add */
-    lua_pushstring(L,"__add");
-    lua_pushcfunction(L,class_add_event);
-    lua_rawset(L,-3);
-    /* 绑定到__sub */
-    lua_pushstring(L,"__sub");
-    lua_pushcfunction(L,class_sub_event);
-    lua_rawset(L,-3);
-    /* 绑定到__mul */
-    lua_pushstring(L,"__mul");
-    lua_pushcfunction(L,class_mul_event);
-    lua_rawset(L,-3);
-    /* 绑定到__div */
-    lua_pushstring(L,"__div");
-    lua_pushcfunction(L,class_div_event);
-    lua_rawset(L,-3);
+        /**************/
+        /* 添加查询函数 */
+        /**************/
+        
+        /* 绑定到__index */
+        setevent(L,"__index",class_index_event);
+        /* 绑定到__newindex */
+        setevent(L,"__newindex",class_newindex_event);
 
-    /***********/
-    /* 比较函数 */
-    /***********/
-    
-    /* 绑定到__lt */
-    lua_pushstring(L,"__lt");
-    lua_pushcfunction(L,class_lt_event);
-    lua_rawset(L,-3);
-    lua_pushstring(L,"__le");
-    lua_pushcfunction(L,class_le_event);
-    lua_rawset(L,-3);
-    lua_pushstring(L,"__eq");
-    lua_pushcfunction(L,class_eq_event);
-    lua_rawset(L,-3);
+        /***********/
+        /* 运算函数 */
+        /***********/
+        
+        for (i=0; tolua_operators[i].key; ++i)
+            if (tolua_operators[i].shared)
+                setkeyevent(L,tolua_operators[i].event,tolua_operators[i].key,class_operator_event);
 
-    lua_pushstring(L,"__call");
-    lua_pushcfunction(L,class_call_event);
-    lua_rawset(L,-3);
+        /***********/
+        /* 比较函数 */
+        /***********/
+        
+        setkeyevent(L,"__lt",".lt",class_compare_event);
+        setkeyevent(L,"__le",".le",class_compare_event);
+        setkeyevent(L,"__eq",".eq",class_eq_event);
 
-    lua_pushstring(L,"__gc");
-    lua_pushstring(L, "tolua_gc_event");
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    /*lua_pushcfunction(L,class_gc_event);*/
-    lua_rawset(L,-3);
-}
+        setkeyevent(L,"__call",".call",class_call_event);
 
+        lua_pushstring(L,"__gc");
+        lua_pushstring(L, "tolua_gc_event");
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        /*lua_pushcfunction(L,class_gc_event);*/
+        lua_rawset(L,-3);
+
+        /* tolua_open之后才有tolua_gc_event，之后才缓存 */
+        lua_pushstring(L,"__gc");
+        lua_rawget(L,-2);
+        if (!lua_isnil(L,-1))
+        {
+            lua_pushstring(L,"tolua_classevents");
+            lua_pushvalue(L,-3);
+            lua_rawset(L,LUA_REGISTRYINDEX);
+        }
+        lua_pop(L,1);
+    }
+
+    /* 拷贝到元表中 */
+    lua_pushnil(L);
+    while (lua_next(L,-2) != 0)             /* stack: mt events k v */
+    {
+        lua_pushvalue(L,-2);
+        lua_insert(L,-2);                   /* stack: mt events k k v */
+        lua_rawset(L,-5);                   /* stack: mt events k */
+    }
+    lua_pop(L,1);                           /* stack: mt */
+}
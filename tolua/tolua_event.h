@@ -40,4 +40,18 @@ TOLUA_API int tolua_ismodulemetatable (lua_State* L);
  */
 TOLUA_API void tolua_classevents (lua_State* L);
 
+/**
+ *  前提：栈顶是类表
+ *
+ *  类表中设置了运算函数key（如".add"）后调用，直接绑定对应的元方法
+ */
+TOLUA_API void tolua_bindoperator (lua_State* L, const char* key);
+
+/**
+ *  前提：栈顶是类表
+ *
+ *  类表链接到基类之后调用，按基类重新解析所有运算元方法
+ */
+TOLUA_API void tolua_inheritoperators (lua_State* L);
+
 #endif
@@ -13,6 +13,7 @@
 */
 
 #include "tolua++.h"
+#include "tolua_type.h"
 #include "lauxlib.h"
 
 #include <stdlib.h>
@@ -24,10 +25,12 @@
  *
  *  比较两个类是否是同个类
  *
+ *  通过类型id在祖先位集中测试，不再访问tolua_super表
+ *
  *  @param L           状态机
  *  @param mt_indexa   表a位置
  *  @param mt_indexb   表b位置
- *  @param super_index 超类表位置
+ *  @param super_index 不再使用，仅为兼容保留
  *
  *  @return 是否表a和表相等
  *  @return 1 : 相等
@@ -35,33 +38,13 @@
  */
 TOLUA_API int tolua_fast_isa(lua_State *L, int mt_indexa, int mt_indexb, int super_index)
 {
-    int result;
+    int a, b;
+    (void)super_index;
     if (lua_rawequal(L,mt_indexa,mt_indexb))
-        result = 1;
-    else
-    {
-        if (super_index) {
-            lua_pushvalue(L, super_index);
-        } else {
-            lua_pushliteral(L,"tolua_super");
-            lua_rawget(L,LUA_REGISTRYINDEX);    /* stack: super:=tolua_super */
-        };
-        /* 在父类中查找类a对应的表 */
-        lua_pushvalue(L,mt_indexa);             /* stack: super mta */
-        lua_rawget(L,-2);                       /* stack: super sta:=super[mta] */
-        
-        /* 在reg中查找类b对应的名字 */
-        lua_pushvalue(L,mt_indexb);             /* stack: super sta mtb */
-        lua_rawget(L,LUA_REGISTRYINDEX);        /* stack: super sta nameb:=reg.mtb */
-        
-        /* 在类a的元表中查找类b的名字 */
-        lua_rawget(L,-2);                       /* stack: super sta bool:=sta.nameb */
-        
-        /* 检查返回值 */
-        result = lua_toboolean(L,-1);
-        lua_pop(L,3);
-    }
-    return result;
+        return 1;
+    a = tolua_mttype(L,mt_indexa);
+    b = tolua_mttype(L,mt_indexb);
+    return tolua_typeisa(tolua_context(L),a,b);
 }
 
 /**
@@ -83,7 +66,12 @@ TOLUA_API const char* tolua_typename (lua_State* L, int lo)
         lua_pushstring(L,lua_typename(L,tag));
     else if (tag == LUA_TUSERDATA)                      /* 对于用户数据 */
     {
-        if (!lua_getmetatable(L,lo))                    /* 若没有元表 */
+        /* tolua创建的用户数据，由类型id得到类型名，包括const */
+        tolua_Box* box = tolua_tobox(L,lo);
+        const char* name = box ? tolua_typeidname(L,box->type) : NULL;
+        if (name)
+            lua_pushstring(L,name);
+        else if (!lua_getmetatable(L,lo))               /* 若没有元表 */
             lua_pushstring(L,lua_typename(L,tag));
         else                                            /* 若有元表 */
         {
@@ -246,6 +234,17 @@ int lua_isusertype (lua_State* L, int lo, const char* type)
         /* check if it is of the same type */
         int r;
         const char *tn;
+        /* tolua创建的用户数据，直接比较类型id */
+        tolua_Box* box = tolua_tobox(L,lo);
+        if (box)
+        {
+            tolua_Context* ctx = tolua_context(L);
+            int id;
+            if (box->flags & TOLUA_BOX_DEAD)    /* 已经失效的对象不再是任何类型 */
+                return 0;
+            id = tolua_findtype(ctx,type);
+            return tolua_typeisa(ctx,box->type,id);
+        }
         /* 获得lo处的元表 */
         if (lua_getmetatable(L,lo))        /* if metatable? */
         {
@@ -255,31 +254,17 @@ int lua_isusertype (lua_State* L, int lo, const char* type)
             tn = lua_tostring(L,-1);
             /* 比较类型 */
             r = tn && (strcmp(tn,type) == 0);
-            lua_pop(L, 1);
             
-            if (r) /* 相同 */
-                return 1;
-            else   /* 不同 */
+            /* check if it is a specialized class */
+            if (!r && tn)
             {
-                /* check if it is a specialized class */
-                
-                /* 检查元表在全局tolua_super中的值 */
-                lua_pushstring(L,"tolua_super");
-                lua_rawget(L,LUA_REGISTRYINDEX); /* get super */
-                lua_getmetatable(L,lo);
-                lua_rawget(L,-2);                /* get super[mt] */
-                if (lua_istable(L,-1)) /* 若是表 */
-                {
-                    int b;
-                    /* 检查是否有如此类型 */
-                    lua_pushstring(L,type);
-                    lua_rawget(L,-2);                /* get super[mt][type] */
-                    b = lua_toboolean(L,-1);
-                    lua_pop(L,3);
-                    if (b)
-                        return 1;
-                }
+                tolua_Context* ctx = tolua_context(L);
+                int a = tolua_findtype(ctx,tn);
+                int b = tolua_findtype(ctx,type);
+                r = tolua_typeisa(ctx,a,b);
             }
+            lua_pop(L, 1);
+            return r;
         }
     }
     return 0;
@@ -514,6 +499,42 @@ TOLUA_API int tolua_isusertype (lua_State* L, int lo, const char* type, int def,
     return 0;
 }
 
+/**
+ *  栈中位置是否为类型id对应的用户数据
+ *
+ *  只比较整数类型id，不需要散列类型名
+ *
+ *  @param L    状态机
+ *  @param lo   栈中位置
+ *  @param type 类型id，由 tolua_usertype 返回
+ *  @param def  预设值
+ *  @param err  错误描述
+ *
+ *  @return 1 : 是
+ *  @return 0 : 否
+ */
+TOLUA_API int tolua_isusertype_id (lua_State* L, int lo, int type, int def, tolua_Error* err)
+{
+    tolua_Box* box;
+    if (def && lua_gettop(L)<abs(lo))
+        return 1;
+    if (lua_isnil(L,lo))
+        return 1;
+    if (!lua_isuserdata(L,lo))
+        push_table_instance(L,lo);
+    box = tolua_tobox(L,lo);
+    /* 已经失效的对象不再是任何类型 */
+    if (box && !(box->flags & TOLUA_BOX_DEAD) &&
+        (box->type == type || tolua_typeisa(tolua_context(L),box->type,type)))
+        return 1;
+    err->index = lo;
+    err->array = 0;
+    err->type = tolua_typeidname(L,type);
+    if (err->type == NULL)
+        err->type = "[undefined]";
+    return 0;
+}
+
 /**
  *  是否为数值数组
  *
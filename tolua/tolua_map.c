@@ -14,12 +14,24 @@
 
 #include "tolua++.h"
 #include "tolua_event.h"
+#include "tolua_type.h"
 #include "lauxlib.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+/* 元表中固定字段的数量：元方法、tolua_ubox、.collector、.get、.set */
+#define TOLUA_CLASSFIELDS   24
 
 
 /**
@@ -31,31 +43,47 @@
  *
  *  @param L    状态机
  *  @param name 注册名称
+ *  @param nrec 预留的字段数量，避免注册成员时反复rehash
  *
  *  @return 1 : 成功
  *  @return 0 : 失败
  */
-static int tolua_newmetatable (lua_State* L, const char* name)
+static int tolua_newmetatable (lua_State* L, const char* name, int nrec)
 {
-    /* 创建一个 表t */
-    /* 注册 表t */
-    /* reg.name = {} */
-    int r = luaL_newmetatable(L,name);
-
 #ifdef LUA_VERSION_NUM          /* lua 5.1 */
+    /* 同luaL_newmetatable，只是按nrec预分配 表t */
+    int r;
+    lua_getfield(L,LUA_REGISTRYINDEX,name);
+    r = lua_isnil(L,-1);
     if (r) {
+        lua_pop(L,1);
+        lua_createtable(L,0,nrec);
+        /* reg.name = t */
+        lua_pushvalue(L,-1);
+        lua_setfield(L,LUA_REGISTRYINDEX,name);
+
+        /* 是将 表t 作为键，name作为值 */
+        /* reg.t = name */
         lua_pushvalue(L, -1);
         lua_pushstring(L, name);
-        
-        /* lua5.1需要重新查询一次，将元表放到栈顶 */
-        /* 是将返回的 表r 作为键，name作为值 */
-        /* reg.r = name */
         lua_settable(L, LUA_REGISTRYINDEX);
     };
+#else
+    /* 创建一个 表t */
+    /* 注册 表t */
+    /* reg.name = {} */
+    int r = luaL_newmetatable(L,name);
 #endif
 
     if (r)
+    {
+        /* 分配类型id，并在registry中保留元表的引用 */
+        int id = tolua_interntype(L,name);
+        lua_pushvalue(L,-1);
+        tolua_context(L)->types[id].mt = luaL_ref(L,LUA_REGISTRYINDEX);
+
         tolua_classevents(L);   /* 重新绑定注册各个元方法 */
+    }
     
     /* 将这个表出栈 */
     lua_pop(L,1);
@@ -67,11 +95,10 @@ static int tolua_newmetatable (lua_State* L, const char* name)
  *
  *  It sets 'name' as being also a 'base', mapping all super classes of 'base' in 'name'
  * 
- *  将基类父类表所有内容加入到子类父类表中
+ *  只记录 name 到 base 的边，祖先位集在需要时一次算出，
+ *  所以基类可以在子类之后注册
  *
- *  1. 获得子类超类，若没有在tolua_super新建一个
- *  2. 获得基类超类
- *  3. 遍历基类超类，并加入子类超类中
+ *  继承关系只保存在c端的类型表中，不再为每个类创建tolua_super中的超类表
  *
  *  @param L    状态机
  *  @param name 子类
@@ -79,72 +106,8 @@ static int tolua_newmetatable (lua_State* L, const char* name)
  */
 static void mapsuper (lua_State* L, const char* name, const char* base)
 {
-    /* 获得 表tolua_super */
-    lua_pushstring(L,"tolua_super");
-    lua_rawget(L,LUA_REGISTRYINDEX);    /* stack: super */
-    
-    /* 获得 表reg.name 入栈 */
-    luaL_getmetatable(L,name);          /* stack: super mt:=reg.name */
-    
-    /* 获得 表reg.name 的 超类table */
-    lua_rawget(L,-2);                   /* stack: super table:=super[mt] */
-    
-    if (lua_isnil(L,-1))                /* 若没有超类，则在tolua_super中新建一个 */
-    {
-        /* 先将栈顶的nil出栈 */
-        lua_pop(L,1);
-        
-        /* 新建 超类table 并入栈 */
-        lua_newtable(L);                /* stack: super table */
-        
-        /* 获得 表reg.name 并入栈 */
-        luaL_getmetatable(L,name);      /* stack: super table mt:=reg.name */
-        
-        /* 复制新建表到栈顶 */
-        lua_pushvalue(L,-2);            /* stack: super table mt table */
-        /* 在tolua_super表中添加 表reg.name 和 超类table */
-        /* tolua_super[mt] = table */
-        lua_rawset(L,-4);               /* stack: super table */
-    }
-
-    /* set base as super class */
-    
-    /* 将 <base, true> 加入 超类table */
-    lua_pushstring(L,base);
-    lua_pushboolean(L,1);
-    /* table.base = true */
-    lua_rawset(L,-3);                   /* stack: super table */
-
-    /* set all super class of base as super class of name */
-    /* 获得 表reg.base */
-    luaL_getmetatable(L,base);          /* stack: super table bmt:=reg.base */
-    /* 查询 表reg.base 的父类 超类st */
-    /* tolua_super[bmt] */
-    lua_rawget(L,-3);                   /* stack: super table st:=super[bmt] */
-    
-    if (lua_istable(L,-1))              /* 若 超类st 是一个表 */
-    {
-        /* 遍历整个 超类st */
-        /* 将所有的键值对加入到 超类table 中 */
-        
-        lua_pushnil(L);                 /* 先将nil入栈作为第一个查询的键 */
-        
-        /* lua_next会在栈上弹出一个键，将下一个键值对入栈，如果没有下个键则不入栈任何元素 */
-        while (lua_next(L,-2) != 0)     /* stack: super table st k v */
-        {
-            /* 将键入栈 */
-            lua_pushvalue(L,-2);        /* stack: super table st k v k */
-            
-            /* 其实就是交换栈顶两个元素的位置，即交换键值对的位置 */
-            lua_insert(L,-2);           /* stack: super table st k k v*/
-            
-            /* 将键值对加入到 超类table 中 */
-            lua_rawset(L,-5);           /* stack: super table st k */
-        }
-    }
-    
-    /* 将剩余元素出栈 */
-    lua_pop(L,3);                       /* stack: <empty> */
+    if (base && *base)
+        tolua_typebase(L,tolua_interntype(L,name),tolua_interntype(L,base));
 }
 
 /**
@@ -214,12 +177,22 @@ static void mapinheritance (lua_State* L, const char* name, const char* base)
 {
     /* set metatable inheritance */
     
+    tolua_Context* ctx = tolua_context(L);
+    int id = tolua_interntype(L,name);
+    int link;
+
     /* 获得 表reg.name */
     luaL_getmetatable(L,name);          /* stack : mt:=reg.name */
     
     if (base && *base)                  /* 当需要从 基类base 继承 */
+    {
         /* 获得 表reg.base */
         luaL_getmetatable(L,base);      /* stack : mt bmt:=reg.base */
+
+        /* 基类还没有注册，在tolua_finalize_types中再链接 */
+        link = lua_isnil(L,-1) ? tolua_interntype(L,base) : -1;
+        ctx->types[id].link = link;
+    }
     else                                /* 从公共父类继承 */
     {
         if (lua_getmetatable(L, -1)) {  /* 子类已经有元表，则不需要再设置 */
@@ -232,13 +205,88 @@ static void mapinheritance (lua_State* L, const char* name, const char* base)
     
     /* mt.ubox = bmt.ubox or {__mode="v"} */
     set_ubox(L);
+    tolua_resetubox(L,id);
+    tolua_touchtype(ctx,id);
 
     /* 将 表mt 的元表设置成 表bmt */
     lua_setmetatable(L,-2);
+
+    /* 从基类继承已经解析好的运算元方法 */
+    tolua_inheritoperators(L);
     
     lua_pop(L,1);                       /* stack : <empty> */
 }
 
+/**
+ *  按拓扑顺序链接类型id的元表，先处理主基类
+ *
+ *  基类注册晚于子类时，子类的元表没有链接到基类，tolua_ubox也是自己新建的，
+ *  这里重新链接，并让子类和基类共用同一个tolua_ubox
+ *
+ *  mark: tolua_typeclosure之后为2，处理过的为3
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ *  @param id  类型id
+ */
+static void linktype (lua_State* L, tolua_Context* ctx, int id)
+{
+    int base, same;
+    if (ctx->types[id].mark != 2)
+        return;
+    ctx->types[id].mark = 3;
+    if (ctx->types[id].nbases == 0)
+        return;
+    base = ctx->types[id].bases[0];
+    linktype(L,ctx,base);
+    if (ctx->types[id].mt == LUA_NOREF || ctx->types[base].mt == LUA_NOREF)
+        return;
+
+    if (ctx->types[id].link >= 0)
+    {
+        mapinheritance(L,ctx->types[id].name,ctx->types[base].name);
+        return;
+    }
+
+    /* 基类的tolua_ubox变了（基类自己刚被链接），子类跟着换 */
+    lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[id].mt);
+    lua_pushstring(L,"tolua_ubox");
+    lua_rawget(L,-2);                       /* stack: mt ubox */
+    lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[base].mt);
+    lua_pushstring(L,"tolua_ubox");
+    lua_rawget(L,-2);                       /* stack: mt ubox bmt bubox */
+    same = lua_isnil(L,-1) || lua_rawequal(L,-1,-3);
+    if (!same)
+    {
+        lua_pushstring(L,"tolua_ubox");
+        lua_insert(L,-2);
+        lua_rawset(L,-5);                   /* mt.tolua_ubox = bubox */
+        tolua_resetubox(L,id);
+        lua_pop(L,3);
+    }
+    else
+        lua_pop(L,4);
+}
+
+/**
+ *  Finalize type hierarchy
+ *
+ *  所有类注册完成后调用（可以多次调用）
+ *
+ *  1. 一次算出所有类型的祖先位集（tolua_typeisa也会按需计算）
+ *  2. 把先于基类注册的子类元表链接到基类上
+ *
+ *  @param L 状态机
+ */
+TOLUA_API void tolua_finalize_types (lua_State* L)
+{
+    tolua_Context* ctx = tolua_context(L);
+    int i;
+    tolua_typeclosure(ctx);
+    for (i=0; i<ctx->ntypes; ++i)
+        linktype(L,ctx,i);
+}
+
 /**
  *  Object type
  *
@@ -261,7 +309,10 @@ static int tolua_bnd_type (lua_State* L)
  *
  *  tolua.takeowership(userdata)
  *
- *  lua垃圾回收机制，增加对象的引用？
+ *  由lua负责回收对象
+ *
+ *  所有权记在数据块的TOLUA_BOX_OWNED标志上，class_gc_event只回收带标志的数据块，
+ *  同一地址上等待回收的旧数据块不会误回收新对象，所以不需要先强制垃圾回收
  *
  *  @param L 状态机
  *
@@ -279,14 +330,6 @@ static int tolua_bnd_takeownership (lua_State* L)
         {
             /* 将元表出栈 */
             lua_pop(L,1);             /* clear metatable off stack */
-            /* force garbage collection to avoid C to reuse a to-be-collected address */
-#ifdef LUA_VERSION_NUM
-            /* 强行进行一次垃圾回收 */
-            lua_gc(L, LUA_GCCOLLECT, 0);
-#else
-            lua_setgcthreshold(L,0);
-#endif
-
             success = tolua_register_gc(L,1);
         }
     }
@@ -301,7 +344,10 @@ static int tolua_bnd_takeownership (lua_State* L)
  *
  *  tolua.releaseownership(userdata)
  *
- *  lua垃圾回收机制，释放cpp对象？
+ *  lua不再负责回收对象
+ *
+ *  tolua的对象只有自己带TOLUA_BOX_OWNED标志时才能释放，
+ *  不会释放掉同一地址上等待回收的旧数据块的所有权，所以不需要先强制垃圾回收
  *
  *  @param L 状态机
  *
@@ -310,42 +356,18 @@ static int tolua_bnd_takeownership (lua_State* L)
 static int tolua_bnd_releaseownership (lua_State* L)
 {
     int done = 0;
-    if (lua_isuserdata(L,1))
+    tolua_Box* box = tolua_tobox(L,1);
+    if (box && (box->flags & TOLUA_BOX_OWNED))
     {
-        /* 获得用户数据地址 */
-        void* u = *((void**)lua_touserdata(L,1));
-        /* force garbage collection to avoid releasing a to-be-collected address */
-#ifdef LUA_VERSION_NUM
-        /* 强制垃圾回收 */
-        lua_gc(L, LUA_GCCOLLECT, 0);
-#else
-        lua_setgcthreshold(L,0);
-#endif
-        /* 入栈reg.tolua_gc表 */
-        lua_pushstring(L,"tolua_gc");
-        lua_rawget(L,LUA_REGISTRYINDEX);
-        
-        /* 入栈用户数据地址 */
-        lua_pushlightuserdata(L,u);
-        /* 在reg.tolua_gc表中查询 */
-        /* 在reg.tolua_gc[用户数据地址] */
-        lua_rawget(L,-2);
-        /* 获取用户数据的元表 */
-        lua_getmetatable(L,1);
-        /* 比较用户数据元表和reg.tolua_gc中查询到的值是否一致 */
-        /* 保证释放对了对象 */
-        if (lua_rawequal(L,-1,-2))  /* check that we are releasing the correct type */
-        {
-            /* 在reg.tolua_gc[用户数据地址] = nil */
-            lua_pushlightuserdata(L,u);
-            lua_pushnil(L);
-            lua_rawset(L,-5);
-            
-            done = 1;
-        }
+        box->flags &= ~TOLUA_BOX_OWNED;
+        box->col = NULL;
+        /* retain过的对象依旧由lua释放引用 */
+        if (!(box->flags & TOLUA_BOX_RETAINED))
+            tolua_unchargebox(tolua_context(L),box);
+        done = 1;
     }
     /* 返回结果 */
-    lua_pushboolean(L,done!=0);
+    lua_pushboolean(L,done);
     return 1;
 }
 
@@ -431,7 +453,7 @@ static int tolua_bnd_inherit (lua_State* L) {
     return 0;
 };
 
-#ifdef LUA_VERSION_NUM /* lua 5.1 */
+#ifdef LUA_VERSION_NUM /* lua 5.1以上 */
 /**
  *
  *  tolua.setpeer(userdata, [table])
@@ -446,6 +468,8 @@ static int tolua_bnd_inherit (lua_State* L) {
  */
 static int tolua_bnd_setpeer(lua_State* L) {
 
+    tolua_Box* box;
+
     /* stack: userdata, table */
     /* 检查栈中对象是否合法 */
     if (!lua_isuserdata(L, -2)) {
@@ -453,13 +477,24 @@ static int tolua_bnd_setpeer(lua_State* L) {
         lua_error(L);
     };
 
+    /* 记下对象是否有peer表，没有的对象查找成员时跳过peer */
+    box = tolua_tobox(L, -2);
+    if (box) {
+        if (lua_isnil(L, -1))
+            box->flags &= ~TOLUA_BOX_HASPEER;
+        else
+            box->flags |= TOLUA_BOX_HASPEER;
+        /* 外部的表不按声明的字段存放 */
+        box->flags &= ~TOLUA_BOX_SLOTPEER;
+    };
+
     if (lua_isnil(L, -1)) { /* 若栈顶为空 */
         lua_pop(L, 1);
         /* 将环境表入栈 */
         lua_pushvalue(L, TOLUA_NOPEER);
     };
     /* 将用户数据的环境表设置为TOLUA_NOPEER */
-    lua_setfenv(L, -2);
+    tolua_setpeertable(L, -2);
 
     return 0;
 };
@@ -473,11 +508,17 @@ static int tolua_bnd_setpeer(lua_State* L) {
  */
 static int tolua_bnd_getpeer(lua_State* L) {
 
+    tolua_Box* box = tolua_tobox(L, -1);
+
+    /* peer表交给lua之后可以直接修改，声明的字段改回以名字为键 */
+    if (box)
+        tolua_unslotpeer(L, box, -1);
+
     /* stack: userdata */
     /* 获取用户数据的环境表 */
-    lua_getfenv(L, -1);
+    tolua_getpeertable(L, -1);
     
-    if (lua_rawequal(L, -1, TOLUA_NOPEER)) { /* 如果环境表不是TOLUA_NOPEER */
+    if (tolua_nopeer(L, -1)) {          /* 如果环境表是TOLUA_NOPEER */
         lua_pop(L, 1);
         /* 返回 nil */
         lua_pushnil(L);
@@ -486,6 +527,127 @@ static int tolua_bnd_getpeer(lua_State* L) {
 };
 #endif
 
+/**
+ *  获得参数1的数组协议，不是数组类型则报错
+ *
+ *  @param L    状态机
+ *  @param name 函数名，用于出错信息
+ *  @param len  返回元素个数
+ *  @param data 返回首元素地址
+ *
+ *  @return 数组协议
+ */
+static const tolua_ArrayDef* checkarray (lua_State* L, const char* name, int* len, void** data)
+{
+    tolua_Box* box = tolua_tobox(L,1);
+    const tolua_ArrayDef* def = box ? tolua_arraydef(tolua_context(L),box->type) : NULL;
+    if (def == NULL)
+        luaL_error(L,"Invalid argument #1 to %s: array usertype expected.",name);
+    if (box->flags & TOLUA_BOX_DEAD)
+        tolua_deaderror(L,box);
+    *len = def->length(box->ptr);
+    *data = tolua_arraydata(def,box->ptr);
+    return def;
+}
+
+/**
+ *  tolua.readrange(obj, [i], [n])
+ *
+ *  一次读出数组中从下标i（从0开始）起的n个元素，超出范围的部分被截掉
+ *
+ *  @param L 状态机
+ *
+ *  @return 1 : 元素组成的表，下标从1开始
+ */
+static int tolua_bnd_readrange (lua_State* L)
+{
+    int len, i, n, k;
+    void* data;
+    const tolua_ArrayDef* def = checkarray(L,"readrange",&len,&data);
+    i = (int)luaL_optnumber(L,2,0);
+    if (i < 0)
+        i = 0;
+    n = (int)luaL_optnumber(L,3,len-i);
+    if (n > len-i)
+        n = len-i;
+    if (n < 0)
+        n = 0;
+    lua_createtable(L,n,0);
+    for (k=0; k<n; ++k)
+    {
+        tolua_pushelem(L,def,data,i+k);
+        lua_rawseti(L,-2,k+1);
+    }
+    return 1;
+}
+
+/**
+ *  tolua.writerange(obj, i, t)
+ *
+ *  把表t中的t[1]..t[#t]一次写入数组从下标i（从0开始）起的位置
+ *
+ *  @param L 状态机
+ *
+ *  @return 0
+ */
+static int tolua_bnd_writerange (lua_State* L)
+{
+    int len, i, n, k;
+    void* data;
+    const tolua_ArrayDef* def = checkarray(L,"writerange",&len,&data);
+    tolua_Box* box = tolua_tobox(L,1);
+    if (box->type & TOLUA_TYPE_CONST)
+        luaL_error(L,"Invalid argument #1 to writerange: const object.");
+    i = (int)luaL_checknumber(L,2);
+    luaL_checktype(L,3,LUA_TTABLE);
+    n = (int)lua_objlen(L,3);
+    if (i < 0 || n > len-i)
+        luaL_error(L,"writerange: range [%d, %d) out of bounds (length %d).",i,i+n,len);
+    for (k=0; k<n; ++k)
+    {
+        lua_rawgeti(L,3,k+1);
+        tolua_setelem(L,def,data,i+k,-1);
+        lua_pop(L,1);
+    }
+    return 0;
+}
+
+/**
+ *  tolua.slabstats()
+ *
+ *  返回内存池的占用情况：
+ *  { pagebytes = n, usedbytes = n, large = n, [1] = { size = 16, blocks = n, used = n }, ... }
+ *
+ *  @param L 状态机
+ *
+ *  @return 1
+ */
+static int tolua_bnd_slabstats (lua_State* L)
+{
+    tolua_SlabStats stats;
+    int i;
+    tolua_slabstats(L,&stats);
+    lua_createtable(L,TOLUA_SLAB_CLASSES,3);
+    lua_pushnumber(L,(lua_Number)stats.pagebytes);
+    lua_setfield(L,-2,"pagebytes");
+    lua_pushnumber(L,(lua_Number)stats.usedbytes);
+    lua_setfield(L,-2,"usedbytes");
+    lua_pushnumber(L,(lua_Number)stats.large);
+    lua_setfield(L,-2,"large");
+    for (i=0; i<TOLUA_SLAB_CLASSES; ++i)
+    {
+        lua_createtable(L,0,3);
+        lua_pushnumber(L,(lua_Number)stats.classes[i].size);
+        lua_setfield(L,-2,"size");
+        lua_pushnumber(L,(lua_Number)stats.classes[i].blocks);
+        lua_setfield(L,-2,"blocks");
+        lua_pushnumber(L,(lua_Number)stats.classes[i].used);
+        lua_setfield(L,-2,"used");
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
 /* static int class_gc_event (lua_State* L); */
 
 /**
@@ -494,12 +656,10 @@ static int tolua_bnd_getpeer(lua_State* L) {
  *
  *      1. reg.tolua_opened = true
  *      2. reg.tolua_value_root = {} -- TOLUA_VALUE_ROOT
- *      3. reg.tolua_peers = {__mode = "k"} -- for lua 5.1
+ *      3. reg.tolua_peers = {__mode = "k"} -- 只用于lua 5.0
  *      4. reg.tolua_ubox = {__mode = "v"}
- *      5. reg.tolua_super = {}
- *      6. reg.tolua_gc = {}
- *      7. reg.tolua_gc_event = cfunc_calss_gc_event(tolua_gc, tolua_super) ... end
- *      8. reg.tolua_commonclass = {
+ *      5. reg.tolua_gc_event = cfunc_calss_gc_event(".collector") ... end
+ *      6. reg.tolua_commonclass = {
  *              __index     = class_index_event,
  *              __newindex  = class_newindex_event,
  *              __add       = class_add_event,
@@ -546,8 +706,8 @@ TOLUA_API void tolua_open (lua_State* L)
         /* 注册 表tolua_value_root */
         lua_rawset(L, LUA_REGISTRYINDEX);
 
-        /* 创建 表tolua_peers 替代lua5.1中的环境表 */
-#ifndef LUA_VERSION_NUM     /* 只对lua5.2有效 */
+        /* 创建 表tolua_peers 替代lua5.1中的环境表、lua5.2以上的uservalue */
+#ifndef LUA_VERSION_NUM     /* 只对lua5.0有效 */
         lua_pushstring(L, "tolua_peers");
         /* 创建一个 表t */
         lua_newtable(L);
@@ -591,29 +751,17 @@ TOLUA_API void tolua_open (lua_State* L)
 //        lua_newtable(L);
 //        lua_rawset(L, LUA_REGISTRYINDEX);
 
-        /* 注册 表tolua_super */
-        lua_pushstring(L,"tolua_super");
-        lua_newtable(L);
-        lua_rawset(L,LUA_REGISTRYINDEX);
-        
-        /* 注册 表tolua_gc */
-        lua_pushstring(L,"tolua_gc");
-        lua_newtable(L);
-        lua_rawset(L,LUA_REGISTRYINDEX);
-
         /* 创建 闭包tolua_gc_event */
+        /* 所有权记在数据块中，不再需要tolua_gc表 */
         lua_pushstring(L, "tolua_gc_event");
         /* 先将闭包的upvalue入栈 */
-        lua_pushstring(L, "tolua_gc");
-        lua_rawget(L, LUA_REGISTRYINDEX);
-        lua_pushstring(L, "tolua_super");
-        lua_rawget(L, LUA_REGISTRYINDEX);
-        lua_pushcclosure(L, class_gc_event, 2);
+        lua_pushliteral(L, ".collector");
+        lua_pushcclosure(L, class_gc_event, 1);
         /* 注册 闭包gc_event */
         lua_rawset(L, LUA_REGISTRYINDEX);
 
         /* 新建一个表，并注册各种元方法 */
-        tolua_newmetatable(L,"tolua_commonclass");
+        tolua_newmetatable(L,"tolua_commonclass",TOLUA_CLASSFIELDS);
 
         /* 貌似什么都没做，将全局表入栈，再出栈 */
         tolua_module(L,NULL,0);
@@ -634,7 +782,10 @@ TOLUA_API void tolua_open (lua_State* L)
                 tolua_function(L,"cast",tolua_bnd_cast);
                 tolua_function(L,"isnull",tolua_bnd_isnulluserdata);
                 tolua_function(L,"inherit", tolua_bnd_inherit);
-#ifdef LUA_VERSION_NUM                          /* lua 5.1 */
+                tolua_function(L,"readrange",tolua_bnd_readrange);
+                tolua_function(L,"writerange",tolua_bnd_writerange);
+                tolua_function(L,"slabstats",tolua_bnd_slabstats);
+#ifdef LUA_VERSION_NUM                          /* lua 5.1以上 */
                 tolua_function(L, "setpeer", tolua_bnd_setpeer);
                 tolua_function(L, "getpeer", tolua_bnd_getpeer);
 #endif
@@ -648,7 +799,8 @@ TOLUA_API void tolua_open (lua_State* L)
 /**
  *  Copy a C object
  *
- *  拷贝一个c对象
+ *  拷贝一个c对象，内存从状态机的内存池中分配，由tolua_default_collect释放。
+ *  c端要用tolua_free释放，见TOLUA_COPY_MALLOC
  *
  *  @param L     状态机
  *  @param value 用户数据
@@ -658,12 +810,14 @@ TOLUA_API void tolua_open (lua_State* L)
  */
 TOLUA_API void* tolua_copy (lua_State* L, void* value, unsigned int size)
 {
-    
-    void* clone = (void*)malloc(size);
-    if (clone)
-        memcpy(clone,value,size);
-    else
+#if TOLUA_COPY_MALLOC
+    void* clone = malloc(size);
+    if (clone == NULL)
         tolua_error(L,"insuficient memory",NULL);
+#else
+    void* clone = tolua_alloc(L,size);
+#endif
+    memcpy(clone,value,size);
     return clone;
 }
 
@@ -680,8 +834,8 @@ TOLUA_API int tolua_default_collect (lua_State* tolua_S)
 {
     /* 获取到用户数据 */
     void* self = tolua_tousertype(tolua_S,1,0);
-    /* 将其释放 */
-    free(self);
+    /* 将其释放，不是内存池分配的对象直接free */
+    tolua_free(tolua_S,self);
     return 0;
 }
 
@@ -699,118 +853,587 @@ TOLUA_API int tolua_default_collect (lua_State* tolua_S)
  */
 TOLUA_API int tolua_register_gc (lua_State* L, int lo)
 {
-    int success = 1;
-    /* 获得用户数据地址 */
-    void *value = *(void **)lua_touserdata(L,lo);
-    
-    /* 将 表tolua_gc 入栈 */
-    lua_pushstring(L,"tolua_gc");
-    lua_rawget(L,LUA_REGISTRYINDEX);
-    
-    /* 将用户数据地址入栈 */
-    lua_pushlightuserdata(L,value);
-    
-    /* 在 表tolua_gc 中查找用户数据对应的值 */
-    lua_rawget(L,-2);
-    
-    /* 如果不为空，则失败，表示这个对象已经被引用 */
-    if (!lua_isnil(L,-1)) /* make sure that object is not already owned */
-        success = 0;
-    else /* 如果为空的话 */
-    {
-        /* 将对象加入tolua_gc中 */
-        lua_pushlightuserdata(L,value);
-        lua_getmetatable(L,lo);
-        lua_rawset(L,-4);
-    }
-    lua_pop(L,2);
-    return success;
+    tolua_Box* box = tolua_tobox(L,lo);
+
+    /* 不是tolua的对象；值类型对象随用户数据一起释放，不能交给回收函数；已经失效的对象；
+       引用计数的对象由release回收，再加回收函数就会析构两次，两者还可能进入不同的队列 */
+    if (box == NULL || (box->flags & (TOLUA_BOX_VALUE | TOLUA_BOX_DEAD | TOLUA_BOX_RETAINED)))
+        return 0;
+    /* make sure that object is not already owned */
+    if (box->flags & TOLUA_BOX_OWNED)
+        return 0;
+
+    /* 所有权和回收函数都记在数据块中，只有这个数据块回收时才调用回收函数 */
+    box->flags |= TOLUA_BOX_OWNED;
+    box->col = tolua_getcollector(L,lo);
+    tolua_chargebox(tolua_context(L),box);
+    tolua_stepexternal(L,tolua_context(L));
+    return 1;
 }
 
 /**
- *  Register a usertype
- *
- *  It creates the correspoding metatable in the registry, for both 'type' and 'const type'.
- *
- *  It maps 'const type' as being also a 'type'
+ *  查询对象的回收函数：元表中的.collector，没有则是tolua_default_collect
  *
- *  在reg中加入两个类型type和const type
+ *  @param L  状态机
+ *  @param lo 对象在栈中位置
  *
- *  并且将type从const type继承？
+ *  @return 回收函数，NULL表示.collector是lua函数，回收时再查询
+ */
+TOLUA_API lua_CFunction tolua_getcollector (lua_State* L, int lo)
+{
+    lua_CFunction col = tolua_default_collect;
+    if (lua_getmetatable(L,lo))
+    {
+        lua_pushliteral(L,".collector");
+        lua_rawget(L,-2);                   /* stack: mt col */
+        if (lua_isfunction(L,-1))
+            col = lua_tocfunction(L,-1);
+        lua_pop(L,2);
+    }
+    return col;
+}
+
+/**
+ *  对象入队，队列满时扩容
  *
- *  @param L    状态机
- *  @param type 类型
+ *  @return 1 : 成功
+ *  @return 0 : 内存不足（在__gc中，不能报错）
  */
-TOLUA_API void tolua_usertype (lua_State* L, const char* type)
+static int pushpending (tolua_Queue* q, const tolua_Pending* p)
 {
-    char ctype[128] = "const ";
-    strncat(ctype,type,120);
+    if (q->n == q->size)
+    {
+        int size = q->size ? q->size*2 : 64;
+        int i;
+        tolua_Pending* items = (tolua_Pending*)malloc(size*sizeof(tolua_Pending));
+        if (items == NULL)
+            return 0;
+        for (i=0; i<q->n; ++i)
+            items[i] = q->items[(q->head + i) & (q->size - 1)];
+        free(q->items);
+        q->items = items;
+        q->size = size;
+        q->head = 0;
+    }
+    q->items[(q->head + q->n) & (q->size - 1)] = *p;
+    q->n++;
+    return 1;
+}
 
-    /* 创建reg["const xxxx"] 和 reg["xxxx"] */
-    if (tolua_newmetatable(L,ctype) && tolua_newmetatable(L,type))
-        mapsuper(L,type,ctype);             /* 'type' is also a 'const type' */
+/**
+ *  队首对象出队
+ *
+ *  @return 1 : 成功
+ *  @return 0 : 队列为空
+ */
+static int poppending (tolua_Queue* q, tolua_Pending* p)
+{
+    if (q->n == 0)
+        return 0;
+    *p = q->items[q->head];
+    q->head = (q->head + 1) & (q->size - 1);
+    q->n--;
+    return 1;
 }
 
+/**
+ *  队列中地址为ptr的对象置空，出队时跳过
+ *
+ *  @return 置空的数量
+ */
+static int droppending (tolua_Queue* q, void* ptr)
+{
+    int i, n = 0;
+    for (i=0; i<q->n; ++i)
+    {
+        tolua_Pending* p = &q->items[(q->head + i) & (q->size - 1)];
+        if (p->ptr == ptr)
+        {
+            p->ptr = NULL;
+            ++n;
+        }
+    }
+    return n;
+}
 
 /**
- *  Begin module
+ *  调用一个对象的回收函数
  *
- *  It pushes the module (or class) table on the stack
+ *  对象的用户数据已经被回收，新建一个没有元表的数据块代替它，
+ *  回收函数中的tolua_tousertype依旧有效
  *
- *  将模块表入栈，或者查询模块表中的内容
+ *  @param L 状态机
+ *  @param p 对象
+ */
+static void callpending (lua_State* L, const tolua_Pending* p)
+{
+    tolua_Box* box;
+    if (p->ptr == NULL)                     /* 已经被tolua_invalidate去掉 */
+        return;
+    if (p->dtor)
+    {
+        p->dtor(p->ptr);
+        return;
+    }
+    lua_pushcfunction(L,p->col);
+    box = (tolua_Box*)lua_newuserdata(L,sizeof(tolua_Box));
+    box->ptr = p->ptr;
+    box->type = p->type;
+    box->magic = TOLUA_BOX_MAGIC;
+    box->flags = 0;
+    box->slot = 0;
+    box->col = NULL;
+    box->ext = 0;
+    lua_call(L,1,0);
+}
+
+/**
+ *  按类型的回收方式（自己没有设置则沿主基类查找）把对象放入延迟回收队列
  *
- *  @param L    状态机
+ *  @param ctx     上下文
+ *  @param box     数据块
+ *  @param col     回收函数，release不为NULL时不用
+ *  @param release 引用计数策略的release，延迟的是release而不是回收函数
  *
- *  @param name 名字空间，模块表
- *  @param name 若为空 : 返回全局表G
- *  @param name 不为空 : 将G.name入栈
+ *  @return 1 : 已放入队列，不需要立即调用回收函数
+ *  @return 0 : 需要立即调用
  */
-TOLUA_API void tolua_beginmodule (lua_State* L, const char* name)
+TOLUA_API int tolua_defercollect (tolua_Context* ctx, tolua_Box* box, lua_CFunction col, tolua_Destructor release)
 {
-    if (name)
+    tolua_Type* t;
+    tolua_Pending p;
+    int n;
+
+    if (ctx->closed)
+        return 0;
+    t = &ctx->types[tolua_typeindex(box->type)];
+    n = ctx->ntypes;                        /* 防止继承关系成环 */
+    while (t->collect == TOLUA_COLLECT_INHERIT && t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+
+    p.ptr = box->ptr;
+    p.type = box->type;
+    p.col = col;
+    p.dtor = release;
+    if (t->collect == TOLUA_COLLECT_THREADSAFE && (release || t->dtor))
     {
-        lua_pushstring(L,name);
-        lua_rawget(L,-2);       /* stack : G G.name */
+        if (release == NULL)
+            p.dtor = t->dtor;
+        return pushpending(&ctx->tscollect,&p);
     }
-    else
-        lua_pushvalue(L,LUA_GLOBALSINDEX);
+    /* 线程安全但这个对象既没有dtor也没有release（不是retain过的对象），只能在__gc中立即回收 */
+    if (t->collect != TOLUA_COLLECT_DEFER)
+        return 0;
+    return pushpending(&ctx->collect,&p);
 }
 
 /**
- *  End module
+ *  Set refcount policy
  *
- *  It pops the module (or class) from the stack
+ *  侵入式引用计数的类：对象的数据块创建时retain，回收时release（按回收方式可以延迟），
+ *  lua持有对象期间对象不会被析构，不需要tolua_add_value_to_root，
+ *  也不需要所有权。子类没有设置时跟随主基类
  *
- *  就是将模块表出栈
- *  即lua_pop(L, 1)
+ *  @param L       状态机
+ *  @param type    类型名
+ *  @param retain  增加引用计数，NULL表示取消策略
+ *  @param release 减少引用计数
+ */
+TOLUA_API void tolua_refclass (lua_State* L, const char* type, tolua_Destructor retain, tolua_Destructor release)
+{
+    int id = tolua_interntype(L,type);
+    tolua_Type* t = &tolua_context(L)->types[id];
+    t->retain = retain;
+    t->release = release;
+}
+
+/**
+ *  Set external size
  *
- *  需要和tolua_beginmodule配合使用
+ *  lua只看到对象的数据块，看不到对象持有的原生内存（纹理、缓冲区等），
+ *  大对象的__gc来得太晚。设置之后，对象交给lua回收（所有权或者retain）时
+ *  extsize(ptr)计入原生内存总数，回收时减去，新增的原生内存按比例推进垃圾回收。
+ *  子类没有设置时跟随主基类
  *
- *  @param L 状态机
+ *  @param L       状态机
+ *  @param type    类型名
+ *  @param extsize 查询对象的原生内存字节数，NULL表示不计入
  */
-TOLUA_API void tolua_endmodule (lua_State* L)
+TOLUA_API void tolua_extclass (lua_State* L, const char* type, tolua_ExternalSize extsize)
 {
-    lua_pop(L,1);
+    int id = tolua_interntype(L,type);
+    tolua_context(L)->types[id].extsize = extsize;
 }
 
 /**
- *  Map module
- *
- *  It creates a new module
+ *  查询类型的extsize，子类没有设置时跟随主基类
+ */
+static tolua_ExternalSize extpolicy (tolua_Context* ctx, int type)
+{
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    int n = ctx->ntypes;                    /* 防止继承关系成环 */
+    while (t->extsize == NULL && t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+    return t->extsize;
+}
+
+/**
+ *  增加原生内存计数
+ */
+static void addexternal (tolua_Context* ctx, size_t bytes)
+{
+    ctx->external += bytes;
+    ctx->extdebt += bytes;
+}
+
+/**
+ *  减少原生内存计数
+ */
+static void subexternal (tolua_Context* ctx, size_t bytes)
+{
+    ctx->external -= bytes < ctx->external ? bytes : ctx->external;
+    ctx->extdebt -= bytes < ctx->extdebt ? bytes : ctx->extdebt;
+}
+
+/**
+ *  对象交给lua回收时计入它的原生内存，已经计入过的不重复计入
  *
- *  在G中查询，或者新建模块表
+ *  在__gc中也可能调用，所以只记账，由tolua_stepexternal推进垃圾回收
  *
- *  @param name 名字空间，模块表
- *  @param name 若为空则直接将全局表G入栈
- *  @param name PS : 不为空的前提是栈顶是全局表
+ *  @param ctx 上下文
+ *  @param box 数据块
+ */
+TOLUA_API void tolua_chargebox (tolua_Context* ctx, tolua_Box* box)
+{
+    tolua_ExternalSize extsize;
+    if (box->ext || box->ptr == NULL)
+        return;
+    extsize = extpolicy(ctx,box->type);
+    if (extsize == NULL)
+        return;
+    box->ext = extsize(box->ptr);
+    addexternal(ctx,box->ext);
+}
+
+/**
+ *  对象不再由lua回收（被回收、释放所有权或者失效）时减去它计入的原生内存
  *
- *  @param hasvar   是否还有变量
+ *  @param ctx 上下文
+ *  @param box 数据块
  */
-#if 1
-TOLUA_API void tolua_module (lua_State* L, const char* name, int hasvar)
+TOLUA_API void tolua_unchargebox (tolua_Context* ctx, tolua_Box* box)
 {
-    if (name)                               /* 若name不为空，则表示栈顶为G */
-    {
+    if (box->ext == 0)
+        return;
+    subexternal(ctx,box->ext);
+    box->ext = 0;
+}
+
+/**
+ *  新增的原生内存超过TOLUA_EXTERNAL_STEP时，按新增的量推进垃圾回收，
+ *  相当于lua自己分配了这么多内存
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ */
+TOLUA_API void tolua_stepexternal (lua_State* L, tolua_Context* ctx)
+{
+    size_t kb;
+    if (ctx->extdebt < TOLUA_EXTERNAL_STEP || ctx->closed)
+        return;
+    kb = ctx->extdebt >> 10;
+    ctx->extdebt = 0;
+    lua_gc(L,LUA_GCSTEP,kb > INT_MAX ? INT_MAX : (int)kb);
+}
+
+/**
+ *  Report external memory
+ *
+ *  报告不属于某个对象，或者对象在生存期间增减的原生内存，
+ *  增加的内存按比例推进垃圾回收
+ *
+ *  @param L     状态机
+ *  @param bytes 增加的字节数，负数表示释放
+ */
+TOLUA_API void tolua_report_external (lua_State* L, long bytes)
+{
+    tolua_Context* ctx = tolua_context(L);
+    if (bytes < 0)
+        subexternal(ctx,(size_t)-bytes);
+    else
+    {
+        addexternal(ctx,(size_t)bytes);
+        tolua_stepexternal(L,ctx);
+    }
+}
+
+/**
+ *  查询当前计入的原生内存总字节数
+ *
+ *  @param L 状态机
+ *
+ *  @return 字节数
+ */
+TOLUA_API size_t tolua_externalbytes (lua_State* L)
+{
+    return tolua_context(L)->external;
+}
+
+/**
+ *  Set collect mode
+ *
+ *  设置类的对象的回收方式，子类没有设置时跟随主基类：
+ *
+ *      TOLUA_COLLECT_INHERIT     跟随主基类（默认），根类没有设置时是TOLUA_COLLECT_NOW
+ *      TOLUA_COLLECT_NOW         在__gc中立即调用回收函数
+ *      TOLUA_COLLECT_DEFER       __gc只把对象放入队列，宿主在合适的时机（如帧结束）
+ *                                调用tolua_drain_collect执行回收函数，
+ *                                昂贵的析构不会落在恰好触发垃圾回收的脚本中
+ *      TOLUA_COLLECT_THREADSAFE  同上，但用dtor析构，不调用.collector。
+ *                                宿主可以用tolua_take_collect取出对象交给工作线程析构。
+ *                                dtor为NULL时类（或主基类）必须已经用tolua_refclass设置了release，
+ *                                否则报错，不会退回到在lua线程中调用.collector
+ *
+ *  @param L    状态机
+ *  @param type 类型名
+ *  @param mode TOLUA_COLLECT_*
+ *  @param dtor TOLUA_COLLECT_THREADSAFE时的析构函数，不能访问lua_State
+ */
+TOLUA_API void tolua_collectmode (lua_State* L, const char* type, int mode, tolua_Destructor dtor)
+{
+    tolua_Context* ctx = tolua_context(L);
+    int id = tolua_interntype(L,type);
+    tolua_Type* t = &ctx->types[id];
+    if (mode < TOLUA_COLLECT_INHERIT || mode > TOLUA_COLLECT_THREADSAFE)
+        luaL_error(L,"invalid collect mode %d for '%s'",mode,type);
+    if (mode == TOLUA_COLLECT_THREADSAFE && dtor == NULL && tolua_refpolicy(ctx,id) == NULL)
+        luaL_error(L,"thread-safe collect mode for '%s' needs a destructor or a refcount policy",type);
+    t->collect = mode;
+    t->dtor = dtor;
+}
+
+/**
+ *  单调时钟，不受系统时间调整影响
+ *
+ *  clock()是进程的cpu时间，回收函数等待io或者其它线程执行时不计入，
+ *  多线程时又会把其它线程的时间算进来，不能用作一帧内的时间预算
+ *
+ *  @return 微秒
+ */
+static double monotonic_us (void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t base;
+    if (base.denom == 0)
+        mach_timebase_info(&base);
+    return (double)mach_absolute_time() * base.numer / base.denom / 1000.0;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0;
+#else
+    return (double)clock() * 1000000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ *  Drain deferred collections
+ *
+ *  调用队列中对象的回收函数，直到用完时间预算。至少回收一个对象
+ *
+ *  时间按单调时钟计算，即墙上时间
+ *
+ *  @param L         状态机
+ *  @param budget_us 时间预算（微秒），<=0表示全部回收
+ *
+ *  @return 队列中剩余的对象数量（包括等待tolua_take_collect的对象）
+ */
+TOLUA_API int tolua_drain_collect (lua_State* L, int budget_us)
+{
+    tolua_Context* ctx = tolua_context(L);
+    double deadline = monotonic_us() + budget_us;
+    tolua_Pending p;
+
+    for (;;)
+    {
+        /* 没有被取走的线程安全对象也在这里析构 */
+        if (!poppending(&ctx->collect,&p) && !poppending(&ctx->tscollect,&p))
+            break;
+        callpending(L,&p);
+        if (budget_us > 0 && monotonic_us() >= deadline)
+            break;
+    }
+    return ctx->collect.n + ctx->tscollect.n;
+}
+
+/**
+ *  Take thread-safe collections
+ *
+ *  取出最多n个可以在其它线程析构的对象，调用者负责调用 out[i].dtor(out[i].ptr)
+ *
+ *  @param L   状态机
+ *  @param out 输出
+ *  @param n   最多取出的数量
+ *
+ *  @return 取出的数量
+ */
+TOLUA_API int tolua_take_collect (lua_State* L, tolua_Garbage* out, int n)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Pending p;
+    int i = 0;
+    while (i < n && poppending(&ctx->tscollect,&p))
+    {
+        if (p.ptr == NULL)                  /* 已经被tolua_invalidate去掉 */
+            continue;
+        out[i].ptr = p.ptr;
+        out[i].dtor = p.dtor;
+        ++i;
+    }
+    return i;
+}
+
+/**
+ *  c对象已经析构，延迟回收队列中它的回收函数和release都不能再调用
+ *
+ *  用户数据__gc时对象已经入队，之后c++端delete并tolua_invalidate，
+ *  队列中的表项不去掉就会重复析构。两个队列都要线性查找，队列为空时没有开销
+ *
+ *  @param ctx 上下文
+ *  @param ptr c对象地址
+ *
+ *  @return 去掉的数量
+ */
+TOLUA_API int tolua_dropcollect (tolua_Context* ctx, void* ptr)
+{
+    return droppending(&ctx->collect,ptr) + droppending(&ctx->tscollect,ptr);
+}
+
+/**
+ *  状态机关闭，回收队列中的所有对象并释放队列
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ */
+TOLUA_API void tolua_closecollect (lua_State* L, tolua_Context* ctx)
+{
+    tolua_Pending p;
+    while (poppending(&ctx->collect,&p) || poppending(&ctx->tscollect,&p))
+        callpending(L,&p);
+    free(ctx->collect.items);
+    free(ctx->tscollect.items);
+    memset(&ctx->collect,0,sizeof(tolua_Queue));
+    memset(&ctx->tscollect,0,sizeof(tolua_Queue));
+}
+
+/**
+ *  注册类型，元表预留nrec个字段
+ *
+ *  @see tolua_usertype
+ */
+static int usertype (lua_State* L, const char* type, int nrec)
+{
+    if (strncmp(type,"const ",6) == 0)
+        return usertype(L,type+6,nrec) | TOLUA_TYPE_CONST;
+
+    /* 创建reg["xxxx"] */
+    if (tolua_newmetatable(L,type,nrec))
+    {
+        /* reg["const xxxx"] = reg["xxxx"]，兼容按名字查询元表的代码 */
+        lua_pushstring(L,"const ");
+        lua_pushstring(L,type);
+        lua_concat(L,2);
+        luaL_getmetatable(L,type);
+        lua_rawset(L,LUA_REGISTRYINDEX);
+    }
+    return tolua_typeid(L,type);
+}
+
+/**
+ *  Register a usertype
+ *
+ *  It creates the correspoding metatable in the registry.
+ *
+ *  'const type' shares the same metatable, the constness is carried as
+ *  TOLUA_TYPE_CONST in the type id of the object.
+ *
+ *  在reg中加入类型type，reg["const type"]只是指向同一个元表
+ *
+ *  @param L    状态机
+ *  @param type 类型
+ *
+ *  @return 类型id，可用于 tolua_isusertype_id 等函数
+ */
+TOLUA_API int tolua_usertype (lua_State* L, const char* type)
+{
+    return usertype(L,type,TOLUA_CLASSFIELDS);
+}
+
+
+/**
+ *  Begin module
+ *
+ *  It pushes the module (or class) table on the stack
+ *
+ *  将模块表入栈，或者查询模块表中的内容
+ *
+ *  @param L    状态机
+ *
+ *  @param name 名字空间，模块表
+ *  @param name 若为空 : 返回全局表G
+ *  @param name 不为空 : 将G.name入栈
+ */
+TOLUA_API void tolua_beginmodule (lua_State* L, const char* name)
+{
+    if (name)
+    {
+        lua_pushstring(L,name);
+        lua_rawget(L,-2);       /* stack : G G.name */
+    }
+    else
+        lua_pushvalue(L,LUA_GLOBALSINDEX);
+}
+
+/**
+ *  End module
+ *
+ *  It pops the module (or class) from the stack
+ *
+ *  就是将模块表出栈
+ *  即lua_pop(L, 1)
+ *
+ *  需要和tolua_beginmodule配合使用
+ *
+ *  @param L 状态机
+ */
+TOLUA_API void tolua_endmodule (lua_State* L)
+{
+    lua_pop(L,1);
+}
+
+/**
+ *  Map module
+ *
+ *  It creates a new module
+ *
+ *  在G中查询，或者新建模块表
+ *
+ *  @param name 名字空间，模块表
+ *  @param name 若为空则直接将全局表G入栈
+ *  @param name PS : 不为空的前提是栈顶是全局表
+ *
+ *  @param hasvar   是否还有变量
+ */
+#if 1
+TOLUA_API void tolua_module (lua_State* L, const char* name, int hasvar)
+{
+    if (name)                               /* 若name不为空，则表示栈顶为G */
+    {
         /* 在全局表中查询 G[name] 元素*/
         lua_pushstring(L,name);
         lua_rawget(L,-2);                   /* stack : G table:=G.name */
@@ -941,17 +1564,9 @@ static void push_collector(lua_State* L, const char* type, lua_CFunction col) {
  */
 TOLUA_API void tolua_cclass (lua_State* L, const char* lname, const char* name, const char* base, lua_CFunction col)
 {
-    char cname[128] = "const ";
-    char cbase[128] = "const ";
-    strncat(cname,name,120);
-    strncat(cbase,base,120);
-
-    /* cname.ubox = name.ubox = base.ubox */
+    /* name.ubox = base.ubox */
     mapinheritance(L,name,base);
-    mapinheritance(L,cname,name);
 
-    /* super.cname <- super.cbase */
-    mapsuper(L,cname,cbase);
     /* super.name <- super.base */
     mapsuper(L,name,base);
 
@@ -970,20 +1585,6 @@ TOLUA_API void tolua_cclass (lua_State* L, const char* lname, const char* name,
     luaL_getmetatable(L,name);      /* stack : module lname mt:=reg.name */
     /* module.lname = mt */
     lua_rawset(L,-3);               /* stack : module */
-
-    /* now we also need to store the collector table for the const
-       instances of the class */
-    
-    /* 在reg.cname中注册垃圾回收函数 */
-    push_collector(L, cname, col);
-    
-    /*
-    luaL_getmetatable(L,cname);
-    lua_pushstring(L,".collector");
-    lua_pushcfunction(L,col);
-    lua_rawset(L,-3);
-    lua_pop(L,1);
-    */
 }
 
 /**
@@ -1000,12 +1601,6 @@ TOLUA_API void tolua_cclass (lua_State* L, const char* lname, const char* name,
  */
 TOLUA_API void tolua_addbase(lua_State* L, char* name, char* base) {
 
-    char cname[128] = "const ";
-    char cbase[128] = "const ";
-    strncat(cname,name,120);
-    strncat(cbase,base,120);
-
-    mapsuper(L,cname,cbase);
     mapsuper(L,name,base);
 };
 
@@ -1027,9 +1622,14 @@ TOLUA_API void tolua_addbase(lua_State* L, char* name, char* base) {
  */
 TOLUA_API void tolua_function (lua_State* L, const char* name, lua_CFunction func)
 {
+    tolua_touchmembers(L,tolua_context(L),-1);
     lua_pushstring(L,name);
     lua_pushcfunction(L,func);
     lua_rawset(L,-3);
+
+    /* 运算函数直接绑定为元方法 */
+    if (name[0] == '.')
+        tolua_bindoperator(L,name);
 }
 
 /* sets the __call event for the class (expects the class' main table on top) */
@@ -1062,12 +1662,41 @@ TOLUA_API void tolua_set_call_event(lua_State* L, lua_CFunction func, char* type
  */
 TOLUA_API void tolua_constant (lua_State* L, const char* name, lua_Number value)
 {
+    tolua_touchmembers(L,tolua_context(L),-1);
     lua_pushstring(L,name);
     tolua_pushnumber(L,value);
     lua_rawset(L,-3);
 }
 
 
+/**
+ *  期望：栈顶有模块表
+ *
+ *  将 module_t[key] 入栈，若没有则新建一个预留nrec个字段的表
+ *
+ *  @param L    状态机
+ *  @param key  ".get" 或 ".set"
+ *  @param nrec 新建时预留的字段数量
+ */
+static void pushaccessors (lua_State* L, const char* key, int nrec)
+{
+    /* 要加入新的get/set函数，成员缓存失效 */
+    tolua_touchmembers(L,tolua_context(L),-1);
+    lua_pushstring(L,key);
+    lua_rawget(L,-2);               /* stack : module_t module_t[key] */
+
+    /* 若没有新建一个表 t 入栈 */
+    if (!lua_istable(L,-1))
+    {
+        lua_pop(L,1);
+        lua_createtable(L,0,nrec);  /* stack : module_t t */
+        lua_pushstring(L,key);
+        lua_pushvalue(L,-2);
+        /* module_t[key] = t */
+        lua_rawset(L,-4);
+    }
+}
+
 /**
  *  Map variable
  *
@@ -1084,27 +1713,11 @@ TOLUA_API void tolua_constant (lua_State* L, const char* name, lua_Number value)
  */
 TOLUA_API void tolua_variable (lua_State* L, const char* name, lua_CFunction get, lua_CFunction set)
 {
-    /* get func */
-    
     /************/
     /* get 函数  */
     /************/
     
-    /* 获得模块表 module_t[".get"] */
-    lua_pushstring(L,".get");
-    lua_rawget(L,-2); /* stack : module_t module_t[".get"] */
-    
-    /* 若没有新建一个表 get_t 入栈 */
-    if (!lua_istable(L,-1))
-    {
-        /* create .get table, leaving it at the top */
-        lua_pop(L,1);
-        lua_newtable(L); /* stack : module_t get_t */
-        lua_pushstring(L,".get");
-        lua_pushvalue(L,-2);
-        /* module_t[".get"] = get_t */
-        lua_rawset(L,-4);
-    }
+    pushaccessors(L,".get",0);          /* stack : module_t get_t */
     
     /* 存入变量 */
     lua_pushstring(L,name);
@@ -1113,8 +1726,6 @@ TOLUA_API void tolua_variable (lua_State* L, const char* name, lua_CFunction get
     
     lua_pop(L,1);                      /* pop .get table */
     
-    /* set func */
-    
     /************/
     /* set 函数  */
     /************/
@@ -1122,17 +1733,7 @@ TOLUA_API void tolua_variable (lua_State* L, const char* name, lua_CFunction get
     /* 和get相似 */
     if (set)
     {
-        lua_pushstring(L,".set");
-        lua_rawget(L,-2);
-        if (!lua_istable(L,-1))
-        {
-            /* create .set table, leaving it at the top */
-            lua_pop(L,1);
-            lua_newtable(L);
-            lua_pushstring(L,".set");
-            lua_pushvalue(L,-2);
-            lua_rawset(L,-4);
-        }
+        pushaccessors(L,".set",0);
         lua_pushstring(L,name);
         lua_pushcfunction(L,set);
         lua_rawset(L,-3);                  /* store variable */
@@ -1158,39 +1759,18 @@ static int const_array (lua_State* L)
 }
 
 /**
- *  Map an array
- *
- *  It assigns an array into the current module (or class)
+ *  新建数组访问表并入栈
  *
- *  期望：栈顶是一个模块表
- *
- *  设置数组的set和get
- *
- *  数组实际上是用到了table的数组部分
+ *  表的元表是自己，__index为get，__newindex为set
  *
  *  @param L    状态机
- *  @param name 变量名
  *  @param get  get方法
- *  @param set  set方法
+ *  @param set  set方法，为空表示常量数组
  */
-TOLUA_API void tolua_array (lua_State* L, const char* name, lua_CFunction get, lua_CFunction set)
+static void pusharray (lua_State* L, lua_CFunction get, lua_CFunction set)
 {
-    /* 获得 get_t */
-    lua_pushstring(L,".get");
-    lua_rawget(L,-2);
-    if (!lua_istable(L,-1))
-    {
-        /* create .get table, leaving it at the top */
-        lua_pop(L,1);
-        lua_newtable(L);
-        lua_pushstring(L,".get");
-        lua_pushvalue(L,-2);
-        lua_rawset(L,-4);
-    }
-    lua_pushstring(L,name);
-
     /* 新建一个表 table */
-    lua_newtable(L);           /* create array metatable */
+    lua_createtable(L,0,2);    /* create array metatable */
         /* 将自己设置为自己的元表 */
         lua_pushvalue(L,-1);
         lua_setmetatable(L,-2);    /* set the own table as metatable (for modules) */
@@ -1204,12 +1784,448 @@ TOLUA_API void tolua_array (lua_State* L, const char* name, lua_CFunction get, l
     /* 若set为空，表示这个数组是一个常量数组 */
     lua_pushcfunction(L,set?set:const_array);
     lua_rawset(L,-3);
+}
+
+/**
+ *  Map an array
+ *
+ *  It assigns an array into the current module (or class)
+ *
+ *  期望：栈顶是一个模块表
+ *
+ *  设置数组的set和get
+ *
+ *  数组实际上是用到了table的数组部分
+ *
+ *  @param L    状态机
+ *  @param name 变量名
+ *  @param get  get方法
+ *  @param set  set方法
+ */
+TOLUA_API void tolua_array (lua_State* L, const char* name, lua_CFunction get, lua_CFunction set)
+{
+    /* 获得 get_t */
+    pushaccessors(L,".get",0);
+    lua_pushstring(L,name);
+    pusharray(L,get,set);
 
     /* 即 get_t[name] = table */
     lua_rawset(L,-3);                  /* store variable */
     lua_pop(L,1);                      /* pop .get table */
 }
 
+/* 列表长度，列表以name为NULL的项结束 */
+#define countdefs(list,n)   do { (n) = 0; if (list) while ((list)[n].name) (n)++; } while (0)
+
+/**
+ *  按类描述注册类型，元表按成员数量预留空间
+ *
+ *  @param L 状态机
+ *  @param d 类描述
+ */
+static void classtype (lua_State* L, const tolua_ClassDef* d)
+{
+    int nmethods, noperators, nconstants;
+    countdefs(d->methods,nmethods);
+    countdefs(d->operators,noperators);
+    countdefs(d->constants,nconstants);
+    usertype(L,d->name,TOLUA_CLASSFIELDS+nmethods+noperators+nconstants);
+}
+
+/**
+ *  期望：栈顶有模块表
+ *
+ *  按类描述映射类及其成员，类型需要已经注册
+ *
+ *  @param L 状态机
+ *  @param d 类描述
+ */
+static void classmembers (lua_State* L, const tolua_ClassDef* d)
+{
+    int i, nvariables, narrays, nset = 0;
+    countdefs(d->variables,nvariables);
+    countdefs(d->arrays,narrays);
+
+    tolua_cclass(L,d->lname,d->name,d->base,d->col);
+    if (d->bases)
+        for (i = 0; d->bases[i]; i++)
+            mapsuper(L,d->name,d->bases[i]);
+
+    luaL_getmetatable(L,d->name);           /* stack : module mt */
+
+    /* 方法和运算符 */
+    if (d->methods)
+        for (i = 0; d->methods[i].name; i++)
+            tolua_function(L,d->methods[i].name,d->methods[i].func);
+    if (d->operators)
+        for (i = 0; d->operators[i].name; i++)
+            tolua_function(L,d->operators[i].name,d->operators[i].func);
+
+    /* 常量 */
+    if (d->constants)
+        for (i = 0; d->constants[i].name; i++)
+            tolua_constant(L,d->constants[i].name,d->constants[i].value);
+
+    /* 变量和数组的get函数 */
+    if (nvariables + narrays > 0)
+    {
+        pushaccessors(L,".get",nvariables+narrays); /* stack : module mt get_t */
+        for (i = 0; i < nvariables; i++)
+        {
+            tolua_function(L,d->variables[i].name,d->variables[i].get);
+            if (d->variables[i].set)
+                nset++;
+        }
+        for (i = 0; i < narrays; i++)
+        {
+            lua_pushstring(L,d->arrays[i].name);
+            pusharray(L,d->arrays[i].get,d->arrays[i].set);
+            lua_rawset(L,-3);
+        }
+        lua_pop(L,1);                       /* stack : module mt */
+    }
+
+    /* 变量的set函数 */
+    if (nset > 0)
+    {
+        pushaccessors(L,".set",nset);       /* stack : module mt set_t */
+        for (i = 0; i < nvariables; i++)
+            if (d->variables[i].set)
+                tolua_function(L,d->variables[i].name,d->variables[i].set);
+        lua_pop(L,1);                       /* stack : module mt */
+    }
+
+    lua_pop(L,1);                           /* stack : module */
+
+    if (d->array)
+        tolua_arrayclass(L,d->name,d->array);
+    if (d->sealed)
+        tolua_sealclass(L,d->name,1);
+    if (d->size)
+        tolua_valueclass(L,d->name,d->size);
+    if (d->retain)
+        tolua_refclass(L,d->name,d->retain,d->release);
+    if (d->extsize)
+        tolua_extclass(L,d->name,d->extsize);
+    if (d->slots)
+        tolua_slotclass(L,d->name,d->slots);
+}
+
+/**
+ *  Map classes from static descriptors
+ *
+ *  期望：栈顶有模块表
+ *
+ *  一次注册defs中的所有类，相当于对每个类依次调用
+ *  tolua_usertype、tolua_cclass、tolua_addbase，再在类表中调用
+ *  tolua_function、tolua_variable、tolua_array、tolua_constant，
+ *  只是元表和.get/.set表按成员数量一次分配好，.get/.set也只查询一次
+ *
+ *  基类需要排在子类前面，或者已经注册过
+ *
+ *  @param L    状态机
+ *  @param defs 类描述数组，以name为NULL的项结束
+ */
+TOLUA_API void tolua_classdefs (lua_State* L, const tolua_ClassDef* defs)
+{
+    const tolua_ClassDef* d;
+
+    /* 先创建所有元表，按成员数量预留空间 */
+    for (d = defs; d->name; d++)
+        classtype(L,d);
+
+    for (d = defs; d->name; d++)
+        classmembers(L,d);
+}
+
+/**
+ *  注册延迟注册的类型
+ *
+ *  先注册还在等待的基类，再在原来的模块表中注册自己，并移除模块中的stub
+ *
+ *  @param L    状态机
+ *  @param type 类型id
+ */
+TOLUA_API void tolua_materialize (lua_State* L, int type)
+{
+    tolua_Context* ctx = tolua_context(L);
+    int id = tolua_typeindex(type);
+    const tolua_ClassDef* d = ctx->types[id].def;
+    int module = ctx->types[id].module;
+    int i, b;
+    if (d == NULL)
+        return;
+
+    /* 先清除，基类注册时不会再回到这里 */
+    ctx->types[id].def = NULL;
+    ctx->types[id].module = LUA_NOREF;
+
+    if (d->base && *d->base && (b = tolua_findtype(ctx,d->base)) >= 0)
+        tolua_materialize(L,b);
+    if (d->bases)
+        for (i = 0; d->bases[i]; i++)
+            if ((b = tolua_findtype(ctx,d->bases[i])) >= 0)
+                tolua_materialize(L,b);
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,module);    /* stack : module */
+    luaL_unref(L,LUA_REGISTRYINDEX,module);
+    classtype(L,d);
+    classmembers(L,d);
+
+    /* 先于它用tolua_cclass注册的子类还没有链接，现在链接，不用等tolua_finalize_types */
+    for (i = 0; i < ctx->ntypes; i++)
+        if (ctx->types[i].link == id && ctx->types[i].mt != LUA_NOREF)
+            mapinheritance(L,ctx->types[i].name,ctx->types[id].name);
+
+    /* module[".lazy"][lname] = nil */
+    lua_pushstring(L,".lazy");
+    lua_rawget(L,-2);                           /* stack : module lazy_t */
+    if (lua_istable(L,-1))
+    {
+        lua_pushstring(L,d->lname);
+        lua_pushnil(L);
+        lua_rawset(L,-3);
+    }
+    lua_pop(L,2);
+}
+
+/**
+ *  Map array protocol
+ *
+ *  为类型登记数组协议，之后 obj[i] 在范围内时直接读写元素，不再查找.geti/.seti，
+ *  tolua.readrange、tolua.writerange 可以一次读写一段元素。子类会继承基类的协议
+ *
+ *  @param L    状态机
+ *  @param type 类型名
+ *  @param def  数组协议，必须一直有效（一般是静态变量）
+ */
+TOLUA_API void tolua_arrayclass (lua_State* L, const char* type, const tolua_ArrayDef* def)
+{
+    int id = tolua_interntype(L,type);
+    tolua_context(L)->types[id].array = def;
+}
+
+/**
+ *  Seal a class
+ *
+ *  密封的类的对象不能设置类中不存在的成员，拼错的成员名直接报错，
+ *  而不是悄悄为对象创建peer表。用tolua.setpeer设置过peer的对象不受影响
+ *
+ *  只作用于这个类本身，不影响子类
+ *
+ *  @param L      状态机
+ *  @param type   类型名
+ *  @param sealed 是否密封
+ */
+TOLUA_API void tolua_sealclass (lua_State* L, const char* type, int sealed)
+{
+    int id = tolua_interntype(L,type);
+    tolua_context(L)->types[id].sealed = sealed;
+}
+
+/**
+ *  Declare Lua-side slots
+ *
+ *  脚本常给c对象加几个字段（状态、计时器、缓存的引用），每个对象都会有一张peer表。
+ *  声明过的字段存放在peer表的数组部分：peer表按字段数量一次分配好，
+ *  访问时按类共用的 名字->下标 表换算，不再给每个对象的peer建散列部分。
+ *  没有声明的字段依旧存放在peer表的散列部分
+ *
+ *  子类继承主基类的字段并排在后面，所以基类要先声明，且要在创建对象的peer之前声明。
+ *  peer表中1..n的整数键留给声明的字段。密封的类只能设置声明的字段
+ *
+ *  @param L     状态机
+ *  @param type  类型名
+ *  @param names 字段名，以NULL结束
+ */
+TOLUA_API void tolua_slotclass (lua_State* L, const char* type, const char* const* names)
+{
+    tolua_Context* ctx = tolua_context(L);
+    int id = tolua_interntype(L,type);
+    tolua_Type* t = &ctx->types[id];
+    tolua_Type* base = t->nbases > 0 ? tolua_slotpolicy(ctx,t->bases[0]) : NULL;
+    int n = 0;
+
+    lua_newtable(L);                                    /* stack: slots */
+    /* 先复制主基类的字段，下标不变 */
+    if (base && base != t)
+    {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,base->slots);   /* stack: slots bslots */
+        lua_pushnil(L);
+        while (lua_next(L,-2))                          /* stack: slots bslots k i */
+        {
+            lua_pushvalue(L,-2);
+            lua_pushvalue(L,-2);
+            lua_rawset(L,-6);                           /* slots[k] = i */
+            lua_pop(L,1);
+        }
+        lua_pop(L,1);                                   /* stack: slots */
+        n = base->slotcount;
+    }
+    for (; names && *names; ++names)
+    {
+        lua_pushstring(L,*names);
+        lua_rawget(L,-2);
+        if (lua_isnil(L,-1))
+        {
+            lua_pushstring(L,*names);
+            lua_pushnumber(L,++n);
+            lua_rawset(L,-4);                           /* slots[name] = n */
+        }
+        lua_pop(L,1);
+    }
+
+    if (t->slots != LUA_NOREF)
+        luaL_unref(L,LUA_REGISTRYINDEX,t->slots);
+    t->slots = luaL_ref(L,LUA_REGISTRYINDEX);           /* stack: - */
+    t->slotcount = n;
+}
+
+/**
+ *  Map value type
+ *
+ *  值类型（如Vec2、Size、Color）的对象按值入栈时，c对象直接存放在用户数据中：
+ *  不需要malloc，不进入tolua_ubox，也没有__gc，tolua_tousertype返回用户数据中的地址。
+ *  同一个c对象每次入栈都是新的用户数据，所以值类型不能依赖对象相等
+ *
+ *  只影响tolua_pushvaluetype，按指针入栈的对象还是普通对象
+ *
+ *  @param L    状态机
+ *  @param type 类型名
+ *  @param size 类型大小，0表示取消
+ */
+TOLUA_API void tolua_valueclass (lua_State* L, const char* type, unsigned int size)
+{
+    int id = tolua_interntype(L,type);
+    tolua_context(L)->types[id].size = size;
+}
+
+/**
+ *  将值类型对象的元表入栈
+ *
+ *  vmt拷贝类的事件闭包，去掉__gc，vmt的元表是类的元表，成员沿元表链查找。
+ *  reg[vmt] = 类型名，tolua_mttype等按元表查询类型的代码依旧有效
+ *
+ *  @param L    状态机
+ *  @param type 类型id
+ */
+TOLUA_API void tolua_pushvaluemt (lua_State* L, int type)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    if (t->vmt == LUA_NOREF)
+    {
+        lua_createtable(L,0,TOLUA_CLASSFIELDS);
+        tolua_classevents(L);               /* stack: vmt */
+        lua_pushstring(L,"__gc");
+        lua_pushnil(L);
+        lua_rawset(L,-3);
+
+        /* reg[vmt] = name */
+        lua_pushvalue(L,-1);
+        lua_pushstring(L,t->name);
+        lua_rawset(L,LUA_REGISTRYINDEX);
+
+        /* setmetatable(vmt, mt) */
+        lua_rawgeti(L,LUA_REGISTRYINDEX,t->mt);
+        lua_setmetatable(L,-2);
+
+        t->vmt = luaL_ref(L,LUA_REGISTRYINDEX);
+
+        /* 运算元方法和类表一致 */
+        lua_rawgeti(L,LUA_REGISTRYINDEX,t->mt);
+        tolua_inheritoperators(L);
+        lua_pop(L,1);
+    }
+    lua_rawgeti(L,LUA_REGISTRYINDEX,t->vmt);
+}
+
+/**
+ *  期望：栈顶有模块表
+ *
+ *  为模块设置模块元表，使得模块中没有的名字会进入module_index_event
+ *
+ *  @param L 状态机
+ */
+static void lazymodule (lua_State* L)
+{
+    if (!tolua_ismodulemetatable(L))
+    {
+        lua_newtable(L);                    /* stack : module vt */
+        tolua_moduleevents(L);
+        if (lua_getmetatable(L,-2))
+            lua_setmetatable(L,-2);         /* setmetatable(vt, oldmt) */
+        lua_setmetatable(L,-2);             /* stack : module */
+    }
+}
+
+/**
+ *  Map classes lazily
+ *
+ *  期望：栈顶有模块表
+ *
+ *  和tolua_classdefs相同，但只在模块中记下stub：
+ *  module[".lazy"][lname] = 类型id
+ *
+ *  第一次从模块中读取lname，或者第一次将该类型的对象入栈时，才真正注册。
+ *  已经注册过（有元表）的类跳过。defs必须一直有效（一般是静态数组）
+ *
+ *  @param L    状态机
+ *  @param defs 类描述数组，以name为NULL的项结束
+ */
+TOLUA_API void tolua_lazyclassdefs (lua_State* L, const tolua_ClassDef* defs)
+{
+    tolua_Context* ctx = tolua_context(L);
+    const tolua_ClassDef* d;
+    int n, module;
+    countdefs(defs,n);
+
+    lazymodule(L);
+    lua_pushvalue(L,-1);
+    module = luaL_ref(L,LUA_REGISTRYINDEX);
+
+    pushaccessors(L,".lazy",n);             /* stack : module lazy_t */
+    for (d = defs; d->name; d++)
+    {
+        int id = tolua_interntype(L,d->name);
+        if (ctx->types[id].def)             /* 已经在等待注册 */
+            continue;
+        if (ctx->types[id].mt != LUA_NOREF) /* 已经注册过，不再重复注册 */
+            continue;
+        ctx->types[id].def = d;
+        lua_rawgeti(L,LUA_REGISTRYINDEX,module);
+        ctx->types[id].module = luaL_ref(L,LUA_REGISTRYINDEX);
+
+        lua_pushstring(L,d->lname);
+        lua_pushnumber(L,(lua_Number)id);
+        lua_rawset(L,-3);                   /* lazy_t[lname] = id */
+    }
+    lua_pop(L,1);                           /* stack : module */
+    luaL_unref(L,LUA_REGISTRYINDEX,module);
+}
+
+/**
+ *  Map module lazily
+ *
+ *  期望：栈顶有模块表
+ *
+ *  第一次从模块中读取name时调用open，调用时栈顶（参数1）为模块表，
+ *  open负责在其中创建name（一般是tolua_module加tolua_beginmodule）
+ *
+ *  @param L    状态机
+ *  @param name 子模块名字
+ *  @param open 打开函数
+ */
+TOLUA_API void tolua_lazymodule (lua_State* L, const char* name, lua_CFunction open)
+{
+    lazymodule(L);
+    pushaccessors(L,".lazy",0);             /* stack : module lazy_t */
+    lua_pushstring(L,name);
+    lua_pushcfunction(L,open);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+}
+
 
 TOLUA_API void tolua_dobuffer(lua_State* L, char* B, unsigned int size, const char* name) {
 
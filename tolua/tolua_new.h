@@ -0,0 +1,39 @@
+/* tolua: c++ object pool helpers
+** Support code for Lua bindings.
+** Written by Waldemar Celes
+** TeCGraf/PUC-Rio
+** Apr 2003
+** $Id: $
+*/
+
+/* This code is free software; you can redistribute it and/or modify it.
+** The software provided hereunder is on an "as is" basis, and
+** the author has no obligation to provide maintenance, support, updates,
+** enhancements, or modifications.
+*/
+
+#ifndef TOLUA_NEW_H
+#define TOLUA_NEW_H
+
+/*
+ *  只给c++绑定代码使用：在tolua的内存池中构造对象需要placement new，
+ *  <new>不放进c和c++共用的tolua++.h
+ */
+#ifndef __cplusplus
+#error "tolua_new.h is for C++ binding code only"
+#endif
+
+#include <new>
+
+#include "tolua++.h"
+
+/* 在tolua的内存池中构造c++对象，如 Mtolua_slab_new(L,Vec2,(x,y))，回收函数中用Mtolua_slab_delete释放 */
+#ifndef Mtolua_slab_new
+#define Mtolua_slab_new(L,T,ARGS) (new (tolua_alloc(L,sizeof(T))) T ARGS)
+#endif
+
+#ifndef Mtolua_slab_delete
+#define Mtolua_slab_delete(L,T,p) ((p)->~T(), tolua_free(L,(void*)(p)))
+#endif
+
+#endif
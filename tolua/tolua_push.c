@@ -13,112 +13,184 @@
 */
 
 #include "tolua++.h"
+#include "tolua_type.h"
 #include "lauxlib.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 /**
+ *  新建一块用户数据指向value，设置元表和环境表
  *
+ *  类有引用计数策略时retain对象，并计入对象的原生内存
+ *
+ *  @param L     状态机
+ *  @param ctx   上下文
+ *  @param t     类型描述
+ *  @param value c对象地址
+ *  @param type  类型id
+ *
+ *  @return 数据块，用户数据在栈顶
+ */
+static tolua_Box* newbox (lua_State* L, tolua_Context* ctx, tolua_Type* t, void* value, int type)
+{
+    tolua_Type* ref = tolua_refpolicy(ctx,type);
+    /* 新建一块用户数据，并把地址指向value，同时记下类型id */
+    tolua_Box* box = (tolua_Box*)lua_newuserdata(L,sizeof(tolua_Box));  /* stack: newud */
+    box->ptr = value;
+    box->type = type;
+    box->magic = TOLUA_BOX_MAGIC;
+    box->flags = 0;
+    box->slot = 0;
+    box->col = NULL;
+    box->ext = 0;
+    if (ref)
+    {
+        ref->retain(value);
+        box->flags |= TOLUA_BOX_RETAINED;
+        tolua_chargebox(ctx,box);
+    }
+    /* 设置用户数据的元表 */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->mt);                   /* stack: newud mt */
+    lua_setmetatable(L,-2);                                     /* update mt, stack: newud */
+
+#ifdef LUA_VERSION_NUM
+    /* 设置用户数据的环境表为registry */
+    lua_pushvalue(L, TOLUA_NOPEER);                             /* stack: newud peer */
+    tolua_setpeertable(L, -2);                                  /* stack: newud */
+#endif
+    return box;
+}
+
+/**
+ *  前提：已有的用户数据在栈顶
+ *
+ *  check the need of updating the metatable to a more specialized class
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param t    类型描述
+ *  @param type 类型id
+ *
+ *  @return 1 : 已经是type或者type的子类，不需要更新
+ *  @return 0 : 更新了类型
+ */
+static int updatebox (lua_State* L, tolua_Context* ctx, tolua_Type* t, int type)
+{
+    /* 用户数据的类型已经是type或者type的子类，则不需要更新 */
+    tolua_Box* box = tolua_tobox(L,-1);
+    if (box && tolua_typeisa(ctx,box->type,type))
+        return 1;
+    /* type represents a more specilized type */
+    /* 只是去掉const时元表不变 */
+    if (box == NULL || tolua_typeindex(box->type) != tolua_typeindex(type))
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, t->mt);               /* stack: ud mt */
+        lua_setmetatable(L,-2);                                 /* stack: ud */
+        /* 换成了子类，回收时使用子类的回收函数 */
+        if (box && (box->flags & TOLUA_BOX_OWNED))
+            box->col = tolua_getcollector(L,-1);
+    }
+    if (box)
+        box->type = type;
+    return 0;
+}
+
+/**
+ *  按类型id将c对象入栈
  *
  *  @param L         状态机
+ *  @param ctx       上下文
  *  @param value     用户数据
- *  @param type      类型
+ *  @param type      类型id
  *  @param addToRoot 是否加入reg.tolua_value_root
  */
-void tolua_pushusertype_internal (lua_State* L, void* value, const char* type, int addToRoot)
+static void pushusertype (lua_State* L, tolua_Context* ctx, void* value, int type, int addToRoot)
 {
     if (value == NULL)
         lua_pushnil(L);
     else
     {
-        /* 查找reg.type */
-        luaL_getmetatable(L, type);                                 /* stack: mt */
-        if (lua_isnil(L, -1)) { /* NOT FOUND metatable */
-            lua_pop(L, 1);
+        tolua_Type* t;
+#if TOLUA_NATIVE_UBOX
+        int root;
+        tolua_BoxEntry* e;
+#endif
+
+        if (type < 0 || tolua_typeindex(type) >= ctx->ntypes)
+            return; /* NOT FOUND metatable */
+        /* 延迟注册的类型，第一次入栈时注册 */
+        if (tolua_ispending(ctx,type))
+            tolua_materialize(L,type);
+        /* const对象和非const对象共用同一个元表，const只记录在类型id中 */
+        t = &ctx->types[tolua_typeindex(type)];
+        if (t->mt == LUA_NOREF)
             return;
+
+#if TOLUA_NATIVE_UBOX
+        /* 对象以 地址+根类 为键，同一继承链上的类共用一个对象 */
+        root = tolua_rootclass(ctx,type);
+        e = tolua_findbox(ctx,value,root);
+        if (e && tolua_pushslot(L,ctx,e->slot))                 /* stack: ud */
+        {
+            /* 根类变化后留下的旧表项，位置可能已经给了别的对象 */
+            if (tolua_tobox(L,-1)->ptr != value)
+            {
+                lua_pop(L,1);
+                e = NULL;
+            }
+        }
+        else
+            e = NULL;
+
+        if (e)
+        {
+            if (updatebox(L,ctx,t,type))
+                return;
+        }
+        else
+        {
+            tolua_Box* box = newbox(L,ctx,t,value,type);        /* stack: newud */
+            tolua_mapbox(L,ctx,box,root);
         }
-        /* 查找reg.type.tolua_ubox */
-        lua_pushstring(L,"tolua_ubox");
-        lua_rawget(L,-2);                                           /* stack: mt ubox */
-        if (lua_isnil(L, -1)) { /* 若没有该字段， 则加入全局的reg.tolua_ubox */
-            lua_pop(L, 1);
-            lua_pushstring(L, "tolua_ubox");
-            lua_rawget(L, LUA_REGISTRYINDEX);
-        };
+#else
+        /* 通过缓存的引用获得reg.type.tolua_ubox，不需要按类型名查询registry */
+        tolua_pushubox(L, ctx, type);                               /* stack: ubox */
         
         /* 将用户数据地址入栈 */
         /* 对象以本身地址为键，不会出现重复的现象 */
-        lua_pushlightuserdata(L,value);                             /* stack: mt ubox key<value> */
+        lua_pushlightuserdata(L,value);                             /* stack: ubox key<value> */
         
         /* 在ubox中获得数据对象 */
-        lua_rawget(L,-2);                                           /* stack: mt ubox ubox[value] */
+        lua_rawget(L,-2);                                           /* stack: ubox ubox[value] */
         
         if (lua_isnil(L,-1)) /* 若为空，需要设置对象，并加入ubox中 */
         {
             /* 先将nil出栈 */
-            lua_pop(L,1);                                           /* stack: mt ubox */
+            lua_pop(L,1);                                           /* stack: ubox */
             /* 将用户数据地址入栈 */
-            lua_pushlightuserdata(L,value);
-            /* 新建一块用户数据，并把地址指向value */
-            *(void**)lua_newuserdata(L,sizeof(void *)) = value;     /* stack: mt ubox value newud */
+            lua_pushlightuserdata(L,value);                         /* stack: ubox value */
+            newbox(L,ctx,t,value,type);                             /* stack: ubox value newud */
             /* 复制用户数据 */
-            lua_pushvalue(L,-1);                                    /* stack: mt ubox value newud newud */
+            lua_pushvalue(L,-1);                                    /* stack: ubox value newud newud */
             /* 将用户数据移动到-4 */
-            lua_insert(L,-4);                                       /* stack: mt newud ubox value newud */
+            lua_insert(L,-4);                                       /* stack: newud ubox value newud */
             /* 用户数据地址和用户数据加入ubox */
-            lua_rawset(L,-3);                  /* ubox[value] = newud, stack: mt newud ubox */
+            lua_rawset(L,-3);                     /* ubox[value] = newud, stack: newud ubox */
             /* 将ubox出栈 */
-            lua_pop(L,1);                                           /* stack: mt newud */
-            /*luaL_getmetatable(L,type);*/
-            /* 将用户数据的元表设置成reg.tolua_ubox */
-            lua_pushvalue(L, -2);                                   /* stack: mt newud mt */
-            lua_setmetatable(L,-2);                      /* update mt, stack: mt newud */
-            
-#ifdef LUA_VERSION_NUM
-            /* 设置用户数据的环境表为registry */
-            lua_pushvalue(L, TOLUA_NOPEER);             /* stack: mt newud peer */
-            lua_setfenv(L, -2);                         /* stack: mt newud */
-#endif
+            lua_pop(L,1);                                           /* stack: newud */
         }
         else /* 若不为空 */
         {
-            /* check the need of updating the metatable to a more specialized class */
-            
             /* 将ubox删除 */
-            lua_insert(L,-2);                                       /* stack: mt ubox[u] ubox */
-            lua_pop(L,1);                                           /* stack: mt ubox[u] */
-            
-            /* 加入全局tolua_super */
-            lua_pushstring(L,"tolua_super");
-            lua_rawget(L,LUA_REGISTRYINDEX);                        /* stack: mt ubox[u] super */
-            
-            /* 获得对象的元表 */
-            lua_getmetatable(L,-2);                                 /* stack: mt ubox[u] super mt */
-            /* 在tolua_super中查找 */
-            lua_rawget(L,-2);                                       /* stack: mt ubox[u] super super[mt] */
-            
-            if (lua_istable(L,-1)) /* 若查找到一个表 */
-            {
-                /* 在这个表中查询类型 type */
-                lua_pushstring(L,type);                             /* stack: mt ubox[u] super super[mt] type */
-                lua_rawget(L,-2);                                   /* stack: mt ubox[u] super super[mt] flag */
-                
-                if (lua_toboolean(L,-1) == 1)                       /* if true */
-                {
-                    lua_pop(L,3);                                   /* mt ubox[u]*/
-                    lua_remove(L, -2);
-                    return;
-                }
-            }
-            /* type represents a more specilized type */
-            /*luaL_getmetatable(L,type);             // stack: mt ubox[u] super super[mt] flag mt */
-            lua_pushvalue(L, -5);                    /* stack: mt ubox[u] super super[mt] flag mt */
-            lua_setmetatable(L,-5);                /* stack: mt ubox[u] super super[mt] flag */
-            lua_pop(L,3);                          /* stack: mt ubox[u] */
+            lua_remove(L,-2);                                       /* stack: ubox[u] */
+            if (updatebox(L,ctx,t,type))
+                return;
         }
-        /* 删除元表 */
-        lua_remove(L, -2);    /* stack: ubox[u]*/
-        
+#endif
+        /* 新对象已经登记在对象表中，可以推进垃圾回收 */
+        tolua_stepexternal(L,ctx);
+
         if (0 != addToRoot)
         {
             /* 将用户数据加入到reg.tolua_value_root */
@@ -128,6 +200,25 @@ void tolua_pushusertype_internal (lua_State* L, void* value, const char* type, i
     } 
 }
 
+/**
+ *  按类型名将c对象入栈
+ *
+ *  @param L         状态机
+ *  @param value     用户数据
+ *  @param type      类型
+ *  @param addToRoot 是否加入reg.tolua_value_root
+ */
+void tolua_pushusertype_internal (lua_State* L, void* value, const char* type, int addToRoot)
+{
+    if (value == NULL)
+        lua_pushnil(L);
+    else
+    {
+        tolua_Context* ctx = tolua_context(L);
+        pushusertype(L, ctx, value, tolua_findtype(ctx, type), addToRoot);
+    }
+}
+
 /**
  *  将栈中位置处数值入栈
  *
@@ -200,6 +291,20 @@ TOLUA_API void tolua_pushusertype (lua_State* L, void* value, const char* type)
     tolua_pushusertype_internal(L, value, type, 0);
 }
 
+/**
+ *  按类型id将c对象入栈
+ *
+ *  类型id由 tolua_usertype 返回，省去按类型名查询
+ *
+ *  @param L     状态机
+ *  @param value 用户数据
+ *  @param type  类型id
+ */
+TOLUA_API void tolua_pushusertype_id (lua_State* L, void* value, int type)
+{
+    pushusertype(L, tolua_context(L), value, type, 0);
+}
+
 TOLUA_API void tolua_pushusertype_and_addtoroot (lua_State* L, void* value, const char* type)
 {
     tolua_pushusertype_internal(L, value, type, 1);
@@ -211,6 +316,71 @@ TOLUA_API void tolua_pushusertype_and_takeownership (lua_State* L, void* value,
     tolua_register_gc(L,lua_gettop(L));
 }
 
+/**
+ *  按值将c对象入栈
+ *
+ *  值类型（见tolua_valueclass）的对象拷贝到新建的用户数据中，没有malloc和__gc，
+ *  不是值类型时报错
+ *
+ *  @param L     状态机
+ *  @param value c对象地址
+ *  @param type  类型id
+ *
+ *  @return 拷贝后的c对象地址，类型未注册时返回NULL
+ */
+TOLUA_API void* tolua_pushvaluetype_id (lua_State* L, const void* value, int type)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Type* t;
+    tolua_Box* box;
+
+    if (value == NULL || type < 0 || tolua_typeindex(type) >= ctx->ntypes)
+    {
+        lua_pushnil(L);
+        return NULL;
+    }
+    if (tolua_ispending(ctx,type))
+        tolua_materialize(L,type);
+    t = &ctx->types[tolua_typeindex(type)];
+    if (t->mt == LUA_NOREF)
+    {
+        lua_pushnil(L);
+        return NULL;
+    }
+
+    if (t->size == 0)                   /* 不是值类型，不知道对象大小 */
+        luaL_error(L,"'%s' is not a value type",t->name);
+
+    /* c对象放在数据块后面，按TOLUA_BOX_HEADER对齐 */
+    box = (tolua_Box*)lua_newuserdata(L,TOLUA_BOX_HEADER+t->size);    /* stack: newud */
+    box->ptr = tolua_valuedata(box);
+    box->type = type;
+    box->magic = TOLUA_BOX_MAGIC;
+    box->flags = TOLUA_BOX_VALUE;
+    box->slot = 0;
+    box->col = NULL;
+    box->ext = 0;
+    memcpy(box->ptr,value,t->size);
+
+    tolua_pushvaluemt(L,type);                                          /* stack: newud vmt */
+    lua_setmetatable(L,-2);                                             /* stack: newud */
+#ifdef LUA_VERSION_NUM
+    lua_pushvalue(L, TOLUA_NOPEER);
+    tolua_setpeertable(L, -2);
+#endif
+    return box->ptr;
+}
+
+/**
+ *  按类型名按值将c对象入栈
+ *
+ *  @see tolua_pushvaluetype_id
+ */
+TOLUA_API void* tolua_pushvaluetype (lua_State* L, const void* value, const char* type)
+{
+    return tolua_pushvaluetype_id(L, value, tolua_findtype(tolua_context(L), type));
+}
+
 /**
  *  前提：用户数据在栈顶
  *
@@ -221,6 +391,14 @@ TOLUA_API void tolua_pushusertype_and_takeownership (lua_State* L, void* value,
  */
 TOLUA_API void tolua_add_value_to_root(lua_State* L, void* ptr)
 {
+    /* 按引用计数策略retain过的对象不需要再加入根表 */
+    tolua_Box* box = tolua_tobox(L, -1);
+    if (box && (box->flags & TOLUA_BOX_RETAINED))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+
     /* 查询reg.tolua_value_root入栈 */
     lua_pushstring(L, TOLUA_VALUE_ROOT);
     lua_rawget(L, LUA_REGISTRYINDEX);                               /* stack: value root */
@@ -373,3 +551,33 @@ TOLUA_API void tolua_pushfieldusertype_and_takeownership (lua_State* L, int lo,
     lua_settable(L,lo);
 }
 
+/**
+ *  将数组中的元素入栈
+ *
+ *  @param L    状态机
+ *  @param def  数组协议
+ *  @param data 首元素地址
+ *  @param i    下标，从0开始，调用者保证在范围内
+ */
+TOLUA_API void tolua_pushelem (lua_State* L, const tolua_ArrayDef* def, void* data, int i)
+{
+    switch (def->elem)
+    {
+        case TOLUA_ELEM_DOUBLE: lua_pushnumber(L,(lua_Number)((double*)data)[i]); break;
+        case TOLUA_ELEM_FLOAT:  lua_pushnumber(L,(lua_Number)((float*)data)[i]); break;
+        case TOLUA_ELEM_INT:    lua_pushnumber(L,(lua_Number)((int*)data)[i]); break;
+        case TOLUA_ELEM_UINT:   lua_pushnumber(L,(lua_Number)((unsigned int*)data)[i]); break;
+        case TOLUA_ELEM_SHORT:  lua_pushnumber(L,(lua_Number)((short*)data)[i]); break;
+        case TOLUA_ELEM_USHORT: lua_pushnumber(L,(lua_Number)((unsigned short*)data)[i]); break;
+        case TOLUA_ELEM_CHAR:   lua_pushnumber(L,(lua_Number)((signed char*)data)[i]); break;
+        case TOLUA_ELEM_UCHAR:  lua_pushnumber(L,(lua_Number)((unsigned char*)data)[i]); break;
+        case TOLUA_ELEM_BOOL:   lua_pushboolean(L,((unsigned char*)data)[i] != 0); break;
+        case TOLUA_ELEM_USERTYPE:
+            /* 元素就在容器中，按地址入栈，不复制 */
+            tolua_pushusertype(L,(char*)data+(size_t)i*def->size,def->type);
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+}
@@ -0,0 +1,345 @@
+/* tolua: object memory pool
+** Support code for Lua bindings.
+** Written by Waldemar Celes
+** TeCGraf/PUC-Rio
+** Apr 2003
+** $Id: $
+*/
+
+/* This code is free software; you can redistribute it and/or modify it.
+** The software provided hereunder is on an "as is" basis, and
+** the author has no obligation to provide maintenance, support, updates,
+** enhancements, or modifications.
+*/
+
+#include "tolua++.h"
+#include "tolua_type.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* 各级别的块大小，对应常见的小结构体（Vec2、Size、Rect、Color、矩阵等），都是16的倍数以保证对齐 */
+static const size_t tolua_slabsizes[TOLUA_SLAB_CLASSES] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+/**
+ *  查询尺寸对应的级别
+ *
+ *  @param size 字节数
+ *
+ *  @return 级别，-1表示超过最大块
+ */
+static int sizeclass (size_t size)
+{
+    int i;
+    for (i=0; i<TOLUA_SLAB_CLASSES; ++i)
+        if (size <= tolua_slabsizes[i])
+            return i;
+    return -1;
+}
+
+/**
+ *  查询地址所在的页
+ *
+ *  @param slab 内存池
+ *  @param p    地址
+ *
+ *  @return 页（或者直接malloc的大块），NULL表示不是内存池分配的
+ */
+static tolua_SlabPage* findpage (tolua_Slab* slab, const char* p)
+{
+    int lo = 0, hi = slab->npages - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        tolua_SlabPage* page = &slab->pages[mid];
+        if (p < page->base)
+            hi = mid - 1;
+        else if (p >= page->base + page->size)
+            lo = mid + 1;
+        else
+            return page;
+    }
+    return NULL;
+}
+
+/**
+ *  按首地址插入一页
+ *
+ *  @param slab   内存池
+ *  @param base   首地址
+ *  @param sclass 级别，-1表示直接malloc的大块
+ *  @param size   字节数
+ *
+ *  @return 1 : 成功
+ *  @return 0 : 内存不足
+ */
+static int addpage (tolua_Slab* slab, char* base, int sclass, size_t size)
+{
+    int pos;
+    if (slab->npages >= slab->sizepages)
+    {
+        int sizepages = slab->sizepages ? slab->sizepages*2 : 16;
+        tolua_SlabPage* pages = (tolua_SlabPage*)realloc(slab->pages,sizepages*sizeof(tolua_SlabPage));
+        if (pages == NULL)
+            return 0;
+        slab->pages = pages;
+        slab->sizepages = sizepages;
+    }
+    for (pos = slab->npages; pos > 0 && slab->pages[pos-1].base > base; --pos)
+        slab->pages[pos] = slab->pages[pos-1];
+    slab->pages[pos].base = base;
+    slab->pages[pos].sclass = sclass;
+    slab->pages[pos].size = size;
+    slab->pages[pos].used = 0;
+    slab->npages++;
+    return 1;
+}
+
+/**
+ *  从页表中删除一页（不释放内存）
+ *
+ *  @param slab 内存池
+ *  @param page 页
+ */
+static void removepage (tolua_Slab* slab, tolua_SlabPage* page)
+{
+    int pos = (int)(page - slab->pages);
+    memmove(page,page+1,(slab->npages-pos-1)*sizeof(tolua_SlabPage));
+    slab->npages--;
+}
+
+/**
+ *  页中的块都已经释放，空闲块多于一页时把这页归还给系统
+ *
+ *  至少保留一页空闲块，分配和释放在页的边界上交替时不会反复malloc/free。
+ *  要从空闲链表中摘掉这页的块，时间与这一级别的空闲块数成正比，
+ *  但每释放一整页的块才发生一次
+ *
+ *  @param slab 内存池
+ *  @param page 空页
+ */
+static void releasepage (tolua_Slab* slab, tolua_SlabPage* page)
+{
+    int sclass = page->sclass;
+    size_t n = TOLUA_SLAB_PAGE / tolua_slabsizes[sclass];
+    const char* base = page->base;
+    void** link = &slab->free[sclass];
+
+    if (slab->blocks[sclass] - slab->used[sclass] < 2*n)
+        return;
+    while (*link)
+    {
+        const char* block = (const char*)*link;
+        if (block >= base && block < base + TOLUA_SLAB_PAGE)
+            *link = *(void**)*link;
+        else
+            link = (void**)*link;
+    }
+    slab->blocks[sclass] -= n;
+    removepage(slab,page);
+    free((void*)base);
+}
+
+/**
+ *  为级别sclass新分配一页，切成块放入空闲链表
+ *
+ *  @param slab   内存池
+ *  @param sclass 级别
+ *
+ *  @return 1 : 成功
+ *  @return 0 : 内存不足
+ */
+static int growslab (tolua_Slab* slab, int sclass)
+{
+    size_t size = tolua_slabsizes[sclass];
+    size_t n = TOLUA_SLAB_PAGE / size;
+    size_t i;
+    char* base;
+
+    base = (char*)malloc(TOLUA_SLAB_PAGE);
+    if (base == NULL)
+        return 0;
+    if (!addpage(slab,base,sclass,TOLUA_SLAB_PAGE))
+    {
+        free(base);
+        return 0;
+    }
+
+    /* 倒序链接，分配时从页首开始 */
+    for (i=n; i-- > 0; )
+    {
+        void** block = (void**)(base + i*size);
+        *block = slab->free[sclass];
+        slab->free[sclass] = block;
+    }
+    slab->blocks[sclass] += n;
+    return 1;
+}
+
+/**
+ *  Allocate from the object pool
+ *
+ *  从状态机的内存池中分配内存，不超过256字节的按尺寸分级从页中分配，
+ *  更大的直接malloc，也登记在页表中。只能用tolua_free释放，不能用free
+ *
+ *  @param L    状态机
+ *  @param size 字节数
+ *
+ *  @return 内存地址，内存不足时报错
+ */
+TOLUA_API void* tolua_alloc (lua_State* L, size_t size)
+{
+    tolua_Slab* slab = &tolua_context(L)->slab;
+    int sclass = sizeclass(size);
+    void** block;
+
+    if (sclass < 0)
+    {
+        block = (void**)malloc(size);
+        if (block == NULL)
+            tolua_error(L,"insuficient memory",NULL);
+        if (!addpage(slab,(char*)block,-1,size))
+        {
+            free(block);
+            tolua_error(L,"insuficient memory",NULL);
+        }
+        slab->large++;
+        return block;
+    }
+    if (slab->free[sclass] == NULL && !growslab(slab,sclass))
+        tolua_error(L,"insuficient memory",NULL);
+
+    block = (void**)slab->free[sclass];
+    slab->free[sclass] = *block;
+    slab->used[sclass]++;
+    findpage(slab,(const char*)block)->used++;
+    return block;
+}
+
+/**
+ *  Free to the object pool
+ *
+ *  释放tolua_alloc分配的内存。不是内存池中的地址按malloc分配的处理，直接free
+ *
+ *  页中的块都释放后，空闲块多于一页时这页归还给系统（见releasepage）。
+ *  上下文释放之后（状态机关闭过程中较晚回收的对象）块不再复用，页空了就释放
+ *
+ *  @param L 状态机
+ *  @param p 内存地址，可为NULL
+ */
+TOLUA_API void tolua_free (lua_State* L, void* p)
+{
+    tolua_Context* ctx;
+    tolua_Slab* slab;
+    tolua_SlabPage* page;
+
+    if (p == NULL)
+        return;
+    ctx = tolua_context(L);
+    slab = &ctx->slab;
+
+    page = findpage(slab,(const char*)p);
+    if (page == NULL)                   /* 调用者malloc的对象 */
+    {
+        free(p);
+        return;
+    }
+    if (page->sclass < 0)               /* 大块 */
+    {
+        removepage(slab,page);
+        slab->large--;
+        free(p);
+    }
+    else if (ctx->closed)               /* 页保留给c端还持有的其它块，最后一块释放时释放页 */
+    {
+        if (--page->used == 0)
+        {
+            char* base = page->base;
+            removepage(slab,page);
+            free(base);
+        }
+    }
+    else
+    {
+        *(void**)p = slab->free[page->sclass];
+        slab->free[page->sclass] = p;
+        slab->used[page->sclass]--;
+        if (--page->used == 0)
+            releasepage(slab,page);
+        return;
+    }
+
+    /* 上下文释放之后页表随最后一页释放 */
+    if (ctx->closed && slab->npages == 0)
+    {
+        free(slab->pages);
+        slab->pages = NULL;
+        slab->sizepages = 0;
+    }
+}
+
+/**
+ *  Object pool statistics
+ *
+ *  查询内存池的占用情况
+ *
+ *  @param L     状态机
+ *  @param stats 输出
+ */
+TOLUA_API void tolua_slabstats (lua_State* L, tolua_SlabStats* stats)
+{
+    tolua_Slab* slab = &tolua_context(L)->slab;
+    int i;
+    memset(stats,0,sizeof(tolua_SlabStats));
+    for (i=0; i<slab->npages; ++i)
+        if (slab->pages[i].sclass >= 0)
+            stats->pagebytes += TOLUA_SLAB_PAGE;
+    stats->large = slab->large;
+    for (i=0; i<TOLUA_SLAB_CLASSES; ++i)
+    {
+        stats->classes[i].size = tolua_slabsizes[i];
+        stats->classes[i].blocks = slab->blocks[i];
+        stats->classes[i].used = slab->used[i];
+        stats->usedbytes += slab->used[i] * tolua_slabsizes[i];
+    }
+}
+
+/**
+ *  释放内存池中没有块在使用的页
+ *
+ *  还有块在使用的页（释放了所有权交给c端的对象、没有tolua_free的tolua_alloc）
+ *  和没有释放的大块都保留在页表中，这些对象在状态机关闭之后依然有效，不会悬空。
+ *  状态机关闭过程中（之后的__gc）释放最后一块时页随之释放；
+ *  lua_close返回后就没有状态机可以传给tolua_free，这时还在c端的块和它们所在的页
+ *  一直占用到进程结束。要在关闭之后释放的对象用malloc分配（见TOLUA_COPY_MALLOC）
+ *
+ *  @param ctx 上下文
+ */
+TOLUA_API void tolua_slabclose (tolua_Context* ctx)
+{
+    tolua_Slab* slab = &ctx->slab;
+    int i, n = 0;
+
+    for (i=0; i<slab->npages; ++i)
+    {
+        tolua_SlabPage* page = &slab->pages[i];
+        if (page->sclass >= 0 && page->used == 0)
+            free(page->base);
+        else
+            slab->pages[n++] = *page;
+    }
+
+    memset(slab->free,0,sizeof(slab->free));
+    memset(slab->blocks,0,sizeof(slab->blocks));
+    memset(slab->used,0,sizeof(slab->used));
+    slab->npages = n;
+    if (n == 0)
+    {
+        free(slab->pages);
+        slab->pages = NULL;
+        slab->sizepages = 0;
+    }
+}
@@ -13,9 +13,11 @@
 */
 
 #include "tolua++.h"
+#include "tolua_type.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 
 
@@ -101,6 +103,31 @@ TOLUA_API void* tolua_tousertype (lua_State* L, int narg, void* def)
     }
 }
 
+/**
+ *  按类型id转换成用户类型
+ *
+ *  类型不符时返回NULL
+ *
+ *  @param L    状态机
+ *  @param narg 栈中位置
+ *  @param type 类型id
+ *  @param def  预设值
+ *
+ *  @return 用户数据类型地址
+ */
+TOLUA_API void* tolua_tousertype_id (lua_State* L, int narg, int type, void* def)
+{
+    tolua_Box* box;
+    if (lua_gettop(L)<abs(narg))
+        return def;
+    if (!lua_isuserdata(L, narg) && !push_table_instance(L, narg))
+        return NULL;
+    box = tolua_tobox(L, narg);
+    if (box == NULL || !tolua_typeisa(tolua_context(L), box->type, type))
+        return NULL;
+    return box->ptr;
+}
+
 /**
  *  检查narg是否在栈中，否则返回预设值
  *
@@ -257,3 +284,64 @@ TOLUA_API int tolua_getfieldboolean (lua_State* L, int lo, int index, int def)
     lua_pop(L,1);
     return v;
 }
+
+/**
+ *  设置数组中的元素
+ *
+ *  整数元素超出类型范围时报错，不截断（浮点数转换超出范围是未定义行为）
+ *
+ *  @param L    状态机
+ *  @param def  数组协议
+ *  @param data 首元素地址
+ *  @param i    下标，从0开始，调用者保证在范围内
+ *  @param lo   新值在栈中位置
+ */
+TOLUA_API void tolua_setelem (lua_State* L, const tolua_ArrayDef* def, void* data, int i, int lo)
+{
+    tolua_Error err;
+    lua_Number v, min, max;
+    if (def->elem == TOLUA_ELEM_BOOL)
+    {
+        ((unsigned char*)data)[i] = (unsigned char)(lua_toboolean(L,lo) != 0);
+        return;
+    }
+    if (def->elem == TOLUA_ELEM_USERTYPE)
+    {
+        /* 按值复制到容器中，tolua_isusertype接受nil，要单独排除 */
+        void* p;
+        if (!tolua_isusertype(L,lo,def->type,0,&err))
+            tolua_error(L,"#vinvalid type in array element assignment",&err);
+        p = tolua_tousertype(L,lo,0);
+        if (p == NULL)
+            luaL_error(L,"cannot assign nil to an element of '%s' array",def->type);
+        memcpy((char*)data+(size_t)i*def->size,p,def->size);
+        return;
+    }
+    if (!tolua_isnumber(L,lo,0,&err))
+        tolua_error(L,"#vinvalid type in array element assignment",&err);
+    v = lua_tonumber(L,lo);
+    switch (def->elem)
+    {
+        case TOLUA_ELEM_INT:    min = INT_MIN;   max = INT_MAX;   break;
+        case TOLUA_ELEM_UINT:   min = 0;         max = UINT_MAX;  break;
+        case TOLUA_ELEM_SHORT:  min = SHRT_MIN;  max = SHRT_MAX;  break;
+        case TOLUA_ELEM_USHORT: min = 0;         max = USHRT_MAX; break;
+        case TOLUA_ELEM_CHAR:   min = SCHAR_MIN; max = SCHAR_MAX; break;
+        case TOLUA_ELEM_UCHAR:  min = 0;         max = UCHAR_MAX; break;
+        default:                min = 0;         max = -1;        break;
+    }
+    /* 转换时向0截断，(min-1, max+1)之内都在范围内；NaN也在这里被拒绝 */
+    if (min <= max && !(v > min - 1 && v < max + 1))
+        luaL_error(L,"value %f out of range in array element assignment",(double)v);
+    switch (def->elem)
+    {
+        case TOLUA_ELEM_DOUBLE: ((double*)data)[i] = (double)v; break;
+        case TOLUA_ELEM_FLOAT:  ((float*)data)[i] = (float)v; break;
+        case TOLUA_ELEM_INT:    ((int*)data)[i] = (int)v; break;
+        case TOLUA_ELEM_UINT:   ((unsigned int*)data)[i] = (unsigned int)v; break;
+        case TOLUA_ELEM_SHORT:  ((short*)data)[i] = (short)v; break;
+        case TOLUA_ELEM_USHORT: ((unsigned short*)data)[i] = (unsigned short)v; break;
+        case TOLUA_ELEM_CHAR:   ((signed char*)data)[i] = (signed char)v; break;
+        case TOLUA_ELEM_UCHAR:  ((unsigned char*)data)[i] = (unsigned char)v; break;
+    }
+}
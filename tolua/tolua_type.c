@@ -0,0 +1,705 @@
+/* tolua: type registry
+** Support code for Lua bindings.
+** Written by Waldemar Celes
+** TeCGraf/PUC-Rio
+** Apr 2003
+** $Id: $
+*/
+
+/* This code is free software; you can redistribute it and/or modify it.
+** The software provided hereunder is on an "as is" basis, and
+** the author has no obligation to provide maintenance, support, updates,
+** enhancements, or modifications.
+*/
+
+#include "tolua++.h"
+#include "tolua_type.h"
+#include "lauxlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* registry中上下文的键，使用静态变量地址作为lightuserdata，避免字符串散列 */
+static char tolua_context_key;
+
+/* 支持线程局部变量的编译器上，每个线程缓存最近使用的上下文 */
+#ifndef TOLUA_THREAD_LOCAL
+#if defined(_MSC_VER)
+#define TOLUA_THREAD_LOCAL  __declspec(thread)
+#elif defined(__GNUC__)
+#define TOLUA_THREAD_LOCAL  __thread
+#endif
+#endif
+
+/* 有上下文释放时加一，使所有线程的缓存失效 */
+static volatile unsigned int tolua_context_epoch;
+
+#ifdef TOLUA_THREAD_LOCAL
+/* 以registry表的地址识别状态机，同一状态机的协程共用registry */
+static TOLUA_THREAD_LOCAL const void* tolua_cache_registry;
+static TOLUA_THREAD_LOCAL tolua_Context* tolua_cache_ctx;
+static TOLUA_THREAD_LOCAL unsigned int tolua_cache_epoch;
+#endif
+
+/**
+ *  字符串散列 (FNV-1a)
+ *
+ *  @param s 字符串
+ *
+ *  @return 散列值
+ */
+static unsigned int hashname (const char* s)
+{
+    unsigned int h = 2166136261u;
+    for (; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+/**
+ *  释放上下文
+ *
+ *  上下文用户数据的__gc元方法
+ *
+ *  @param L 状态机
+ *
+ *  @return 0
+ */
+static int context_gc (lua_State* L)
+{
+    tolua_Context* ctx = (tolua_Context*)lua_touserdata(L,1);
+    tolua_Slab slab;
+    int i;
+    /* 先回收还在队列中的对象，回收函数可能用到类型信息 */
+    tolua_closecollect(L,ctx);
+    for (i=0; i<ctx->ntypes; ++i)
+    {
+        free(ctx->types[i].name);
+        free(ctx->types[i].cname);
+        free(ctx->types[i].bases);
+    }
+    free(ctx->types);
+    free(ctx->names);
+    free(ctx->ancestors);
+    tolua_slabclose(ctx);
+    tolua_boxclose(ctx);
+    /* 状态机关闭时，之后才回收的对象可能还会调用tolua_free，保留剩下的页表 */
+    slab = ctx->slab;
+    memset(ctx,0,sizeof(tolua_Context));
+    ctx->slab = slab;
+    ctx->closed = 1;
+    /* 新状态机的registry可能分配在同一地址上 */
+    ++tolua_context_epoch;
+    return 0;
+}
+
+/**
+ *  获得状态机对应的上下文
+ *
+ *  reg[&tolua_context_key] = ctx
+ *
+ *  类型检查每次都要用到上下文，同一线程连续访问同一状态机时直接返回缓存，不查询registry
+ *
+ *  @param L 状态机
+ *
+ *  @return 上下文
+ */
+TOLUA_API tolua_Context* tolua_context (lua_State* L)
+{
+    tolua_Context* ctx;
+#ifdef TOLUA_THREAD_LOCAL
+    const void* registry = lua_topointer(L,LUA_REGISTRYINDEX);
+    if (registry == tolua_cache_registry && tolua_cache_epoch == tolua_context_epoch)
+        return tolua_cache_ctx;
+#endif
+
+    lua_pushlightuserdata(L,&tolua_context_key);
+    lua_rawget(L,LUA_REGISTRYINDEX);                /* stack: ctx */
+    ctx = (tolua_Context*)lua_touserdata(L,-1);
+    lua_pop(L,1);
+
+    if (ctx == NULL)                                /* 第一次访问，新建上下文 */
+    {
+        lua_pushlightuserdata(L,&tolua_context_key);
+        ctx = (tolua_Context*)lua_newuserdata(L,sizeof(tolua_Context));
+        memset(ctx,0,sizeof(tolua_Context));        /* stack: key ctx */
+        ctx->boxes = LUA_NOREF;
+
+        /* 设置__gc，随状态机一起释放 */
+        lua_newtable(L);
+        lua_pushliteral(L,"__gc");
+        lua_pushcfunction(L,context_gc);
+        lua_rawset(L,-3);
+        lua_setmetatable(L,-2);
+
+        lua_rawset(L,LUA_REGISTRYINDEX);            /* stack: <empty> */
+    }
+
+#ifdef TOLUA_THREAD_LOCAL
+    /* 已经释放的上下文（关闭状态机时的__gc中）不缓存 */
+    if (!ctx->closed)
+    {
+        tolua_cache_registry = registry;
+        tolua_cache_ctx = ctx;
+        tolua_cache_epoch = tolua_context_epoch;
+    }
+#endif
+    return ctx;
+}
+
+/**
+ *  查询类型名对应的id
+ *
+ *  @param ctx  上下文
+ *  @param name 类型名
+ *
+ *  @return 类型id，-1表示未注册
+ */
+TOLUA_API int tolua_findtype (tolua_Context* ctx, const char* name)
+{
+    unsigned int mask, i;
+    tolua_TypeCache* c;
+    const char* base;
+    int cflag = 0;
+    if (ctx->sizenames == 0 || name == NULL)
+        return -1;
+
+    /* 先按指针查询缓存，指针可能被复用，所以还要比较内容 */
+    c = &ctx->typecache[((size_t)name >> 3) & (TOLUA_TYPECACHE - 1)];
+    if (c->name == name)
+    {
+        /* 复用的指针可能指向更短的字符串，先确认前缀再跳过 */
+        base = name;
+        if (c->id & TOLUA_TYPE_CONST)
+            base = strncmp(name, "const ", 6) == 0 ? name + 6 : NULL;
+        if (base && strcmp(ctx->types[tolua_typeindex(c->id)].name, base) == 0)
+            return c->id;
+    }
+
+    /* "const X" 和 X 共用同一个类型 */
+    base = name;
+    if (strncmp(name, "const ", 6) == 0)
+    {
+        base = name + 6;
+        cflag = TOLUA_TYPE_CONST;
+    }
+
+    mask = (unsigned int)ctx->sizenames - 1;
+    for (i = hashname(base) & mask; ctx->names[i] >= 0; i = (i + 1) & mask)
+    {
+        if (strcmp(ctx->types[ctx->names[i]].name, base) == 0)
+        {
+            c->name = name;
+            c->id = ctx->names[i] | cflag;
+            return c->id;
+        }
+    }
+    return -1;
+}
+
+/**
+ *  将类型id放入名字散列表
+ *
+ *  @param ctx 上下文
+ *  @param id  类型id
+ */
+static void insertname (tolua_Context* ctx, int id)
+{
+    unsigned int mask = (unsigned int)ctx->sizenames - 1;
+    unsigned int i = hashname(ctx->types[id].name) & mask;
+    while (ctx->names[i] >= 0)
+        i = (i + 1) & mask;
+    ctx->names[i] = id;
+}
+
+/**
+ *  名字散列表扩容，保证装载因子不超过1/2
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ */
+static void growtypes (lua_State* L, tolua_Context* ctx)
+{
+    if (ctx->ntypes >= ctx->sizetypes)
+    {
+        int size = ctx->sizetypes ? ctx->sizetypes*2 : 64;
+        int words = size/32;
+        int i;
+        tolua_Type* types;
+        /* 先分配新的位集，realloc成功后types立即生效，失败时原来的数组都不变 */
+        unsigned int* ancestors = (unsigned int*)calloc((size_t)size*words,sizeof(unsigned int));
+        if (ancestors == NULL)
+            tolua_error(L,"insuficient memory",NULL);
+        types = (tolua_Type*)realloc(ctx->types,size*sizeof(tolua_Type));
+        if (types == NULL)
+        {
+            free(ancestors);
+            tolua_error(L,"insuficient memory",NULL);
+        }
+        ctx->types = types;
+        /* 拷贝原有的祖先位集，每行变宽 */
+        for (i=0; i<ctx->ntypes; ++i)
+            memcpy(ancestors+(size_t)i*words,tolua_ancestors(ctx,i),ctx->words*sizeof(unsigned int));
+        free(ctx->ancestors);
+        ctx->sizetypes = size;
+        ctx->ancestors = ancestors;
+        ctx->words = words;
+    }
+    if (ctx->ntypes*2 >= ctx->sizenames)
+    {
+        int i;
+        int size = ctx->sizenames ? ctx->sizenames*2 : 128;
+        int* names = (int*)malloc(size*sizeof(int));
+        if (names == NULL)
+            tolua_error(L,"insuficient memory",NULL);
+        for (i=0; i<size; ++i)
+            names[i] = -1;
+        free(ctx->names);
+        ctx->names = names;
+        ctx->sizenames = size;
+        for (i=0; i<ctx->ntypes; ++i)
+            insertname(ctx,i);
+    }
+}
+
+/**
+ *  注册类型名
+ *
+ *  @param L    状态机
+ *  @param name 类型名
+ *
+ *  @return 类型id
+ */
+TOLUA_API int tolua_interntype (lua_State* L, const char* name)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Type* t;
+    int id;
+    if (strncmp(name, "const ", 6) == 0)
+        return tolua_interntype(L, name + 6) | TOLUA_TYPE_CONST;
+
+    id = tolua_findtype(ctx,name);
+    if (id >= 0)
+        return id;
+
+    growtypes(L,ctx);
+    id = ctx->ntypes;
+    t = &ctx->types[id];
+    memset(t,0,sizeof(tolua_Type));
+    t->mt = LUA_NOREF;
+    t->ubox = LUA_NOREF;
+    t->module = LUA_NOREF;
+    t->link = -1;
+    t->firstsub = -1;
+    t->nextsub = -1;
+    t->mcache = LUA_NOREF;
+    t->gcache = LUA_NOREF;
+    t->scache = LUA_NOREF;
+    t->nmiss = 0;
+    t->cachegen = -1;
+    t->vmt = LUA_NOREF;
+    t->collect = TOLUA_COLLECT_INHERIT;
+    t->slots = LUA_NOREF;
+    t->name = (char*)malloc(strlen(name)+1);
+    if (t->name == NULL)
+        tolua_error(L,"insuficient memory",NULL);
+    strcpy(t->name,name);
+
+    ctx->ntypes++;
+    insertname(ctx,id);
+    return id;
+}
+
+/**
+ *  将类型对应的tolua_ubox表入栈
+ *
+ *  reg.type.tolua_ubox 或者全局的 reg.tolua_ubox
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param type 类型id
+ */
+TOLUA_API void tolua_pushubox (lua_State* L, tolua_Context* ctx, int type)
+{
+    type = tolua_typeindex(type);
+    if (ctx->types[type].ubox == LUA_NOREF)
+    {
+        /* 查找reg.type.tolua_ubox */
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[type].mt);  /* stack: mt */
+        lua_pushstring(L,"tolua_ubox");
+        lua_rawget(L,-2);                                       /* stack: mt ubox */
+        if (lua_isnil(L,-1)) { /* 若没有该字段， 则使用全局的reg.tolua_ubox */
+            lua_pop(L,1);
+            lua_pushstring(L,"tolua_ubox");
+            lua_rawget(L,LUA_REGISTRYINDEX);
+        }
+        lua_remove(L,-2);                                       /* stack: ubox */
+        lua_pushvalue(L,-1);
+        ctx->types[type].ubox = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    else
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->types[type].ubox);
+}
+
+/**
+ *  清除缓存的tolua_ubox引用
+ *
+ *  @param L    状态机
+ *  @param type 类型id
+ */
+TOLUA_API void tolua_resetubox (lua_State* L, int type)
+{
+    tolua_Context* ctx = tolua_context(L);
+    if (type < 0)
+        return;
+    type = tolua_typeindex(type);
+    if (ctx->types[type].ubox != LUA_NOREF)
+    {
+        luaL_unref(L,LUA_REGISTRYINDEX,ctx->types[type].ubox);
+        ctx->types[type].ubox = LUA_NOREF;
+    }
+}
+
+/**
+ *  记录继承关系
+ *
+ *  将base以及base的所有祖先加入type的祖先位集
+ *
+ *  @param L    状态机
+ *  @param type 子类id
+ *  @param base 基类id
+ */
+TOLUA_API void tolua_typebase (lua_State* L, int type, int base)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Type* t;
+    int* bases;
+    int i;
+    type = tolua_typeindex(type);
+    base = tolua_typeindex(base);
+    if (type == base)
+        return;
+
+    t = &ctx->types[type];
+    for (i=0; i<t->nbases; ++i)
+    {
+        if (t->bases[i] == base)
+            return;
+    }
+    bases = (int*)realloc(t->bases,(t->nbases+1)*sizeof(int));
+    if (bases == NULL)
+        tolua_error(L,"insuficient memory",NULL);
+    bases[t->nbases++] = base;
+    t->bases = bases;
+    /* 主基类的子类链表，运算元方法沿它传给子类；原来是根类，对象表的键跟着换 */
+    if (t->nbases == 1)
+    {
+        t->nextsub = ctx->types[base].firstsub;
+        ctx->types[base].firstsub = type;
+        if (ctx->nmap > 0)
+            tolua_reroot(ctx,type,tolua_rootclass(ctx,base));
+    }
+    ctx->dirty = 1;
+}
+
+/**
+ *  深度优先，先算出所有基类的祖先位集，再合并到id的位集中
+ *
+ *  mark: 0 未访问，1 正在访问（用于忽略环），2 已完成
+ */
+static void closetype (tolua_Context* ctx, int id)
+{
+    tolua_Type* t = &ctx->types[id];
+    unsigned int* set = tolua_ancestors(ctx,id);
+    int i, j;
+    if (t->mark)
+        return;
+    t->mark = 1;
+    for (i=0; i<t->nbases; ++i)
+    {
+        int base = t->bases[i];
+        unsigned int* bset = tolua_ancestors(ctx,base);
+        closetype(ctx,base);
+        tolua_setbit(set,base);
+        for (j=0; j<ctx->words; ++j)
+            set[j] |= bset[j];
+    }
+    t->mark = 2;
+}
+
+/**
+ *  计算继承关系的传递闭包
+ *
+ *  注册时只记录直接基类，这里一次算出所有类型的祖先位集，
+ *  和注册顺序无关，每条边只处理一次
+ *
+ *  @param ctx 上下文
+ */
+TOLUA_API void tolua_typeclosure (tolua_Context* ctx)
+{
+    int i;
+    if (ctx->ancestors)
+        memset(ctx->ancestors,0,(size_t)ctx->sizetypes*ctx->words*sizeof(unsigned int));
+    for (i=0; i<ctx->ntypes; ++i)
+        ctx->types[i].mark = 0;
+    for (i=0; i<ctx->ntypes; ++i)
+        closetype(ctx,i);
+    ctx->dirty = 0;
+}
+
+/**
+ *  类型a是否为类型b
+ *
+ *  在a的祖先位集中测试b
+ *
+ *  非const对象可以当作const对象使用，反之则不行
+ *
+ *  @param ctx 上下文
+ *  @param a   类型a
+ *  @param b   类型b
+ *
+ *  @return 1 : 是
+ *  @return 0 : 否
+ */
+TOLUA_API int tolua_typeisa (tolua_Context* ctx, int a, int b)
+{
+    if (a == b)
+        return 1;
+    if (a < 0 || b < 0)
+        return 0;
+    if ((a & TOLUA_TYPE_CONST) && !(b & TOLUA_TYPE_CONST))
+        return 0;
+    a = tolua_typeindex(a);
+    b = tolua_typeindex(b);
+    if (ctx->dirty)
+        tolua_typeclosure(ctx);
+    return a == b || tolua_testbit(tolua_ancestors(ctx,a),b);
+}
+
+/**
+ *  类型id的类表发生了变化
+ *
+ *  @param ctx 上下文
+ *  @param id  类型id
+ */
+TOLUA_API void tolua_touchtype (tolua_Context* ctx, int id)
+{
+    ++ctx->generation;
+    ctx->types[tolua_typeindex(id)].stamp = ctx->generation;
+}
+
+/**
+ *  栈中lo处的表中加入了成员
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ *  @param lo  类表或者模块表在栈中位置
+ */
+TOLUA_API void tolua_touchmembers (lua_State* L, tolua_Context* ctx, int lo)
+{
+    int id;
+    /* 注册阶段还没有任何缓存，不需要查询是哪个类 */
+    if (!ctx->cached)
+        return;
+    id = tolua_mttype(L,lo);
+    if (id >= 0)
+        tolua_touchtype(ctx,id);
+}
+
+/**
+ *  缓存建立（gen）之后，类型自己或者祖先的类表是否发生过变化
+ *
+ *  @param ctx 上下文
+ *  @param id  类型下标
+ *  @param gen 缓存最后一次确认有效时的generation
+ *
+ *  @return 1 : 缓存过期
+ */
+static int cachestale (tolua_Context* ctx, int id, int gen)
+{
+    unsigned int* set;
+    int w, b;
+    if (ctx->types[id].stamp > gen)
+        return 1;
+    if (ctx->dirty)
+        tolua_typeclosure(ctx);
+    set = tolua_ancestors(ctx,id);
+    for (w = 0; w < ctx->words; ++w)
+    {
+        if (set[w] == 0)
+            continue;
+        for (b = 0; b < 32; ++b)
+            if (tolua_testbit(set,w*32+b) && ctx->types[w*32+b].stamp > gen)
+                return 1;
+    }
+    return 0;
+}
+
+/**
+ *  获得类型的成员缓存
+ *
+ *  每个类一个展平的方法表、get函数表和set函数表，第一次查找某个键时从元表链上填入。
+ *  ctx->generation变化后第一次访问时检查自己和祖先的类表是否变过，变过才换成新的空表
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param type 类型id
+ *
+ *  @return 类型描述
+ */
+TOLUA_API tolua_Type* tolua_membercache (lua_State* L, tolua_Context* ctx, int type)
+{
+    int id = tolua_typeindex(type);
+    tolua_Type* t = &ctx->types[id];
+    if (t->cachegen == ctx->generation)
+        return t;
+    if (t->mcache == LUA_NOREF || cachestale(ctx,id,t->cachegen))
+    {
+        luaL_unref(L,LUA_REGISTRYINDEX,t->mcache);
+        luaL_unref(L,LUA_REGISTRYINDEX,t->gcache);
+        luaL_unref(L,LUA_REGISTRYINDEX,t->scache);
+        lua_newtable(L);
+        t->mcache = luaL_ref(L,LUA_REGISTRYINDEX);
+        lua_newtable(L);
+        t->gcache = luaL_ref(L,LUA_REGISTRYINDEX);
+        lua_newtable(L);
+        t->scache = luaL_ref(L,LUA_REGISTRYINDEX);
+        t->nmiss = 0;
+        ctx->cached = 1;
+    }
+    t->cachegen = ctx->generation;
+    return t;
+}
+
+/**
+ *  查询类型的数组协议
+ *
+ *  @param ctx  上下文
+ *  @param type 类型id
+ *
+ *  @return 数组协议，NULL表示没有
+ */
+TOLUA_API const tolua_ArrayDef* tolua_arraydef (tolua_Context* ctx, int type)
+{
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    int n = ctx->ntypes;                /* 防止继承关系成环 */
+    while (t->array == NULL && t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+    return t->array;
+}
+
+/**
+ *  查询类型的引用计数策略
+ *
+ *  @param ctx  上下文
+ *  @param type 类型id
+ *
+ *  @return 设置了策略的类型，NULL表示没有
+ */
+TOLUA_API tolua_Type* tolua_refpolicy (tolua_Context* ctx, int type)
+{
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    int n = ctx->ntypes;                /* 防止继承关系成环 */
+    while (t->retain == NULL && t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+    return t->retain ? t : NULL;
+}
+
+/**
+ *  查询类型声明的lua端字段
+ *
+ *  @param ctx  上下文
+ *  @param type 类型id
+ *
+ *  @return 声明了字段的类型，NULL表示没有
+ */
+TOLUA_API tolua_Type* tolua_slotpolicy (tolua_Context* ctx, int type)
+{
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    int n = ctx->ntypes;                /* 防止继承关系成环 */
+    while (t->slots == LUA_NOREF && t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+    return t->slots != LUA_NOREF ? t : NULL;
+}
+
+/**
+ *  查询元表对应的类型id
+ *
+ *  通过 reg[mt] 获得类型名
+ *
+ *  @param L  状态机
+ *  @param mt 元表在栈中位置
+ *
+ *  @return 类型id，-1表示不是tolua的元表
+ */
+TOLUA_API int tolua_mttype (lua_State* L, int mt)
+{
+    int id = -1;
+    lua_pushvalue(L,mt);
+    lua_rawget(L,LUA_REGISTRYINDEX);                /* stack: name:=reg[mt] */
+    if (lua_isstring(L,-1))
+        id = tolua_findtype(tolua_context(L),lua_tostring(L,-1));
+    lua_pop(L,1);
+    return id;
+}
+
+/**
+ *  获得用户数据块
+ *
+ *  @param L  状态机
+ *  @param lo 栈中位置
+ *
+ *  @return 数据块，不是tolua用户数据则返回NULL
+ */
+TOLUA_API tolua_Box* tolua_tobox (lua_State* L, int lo)
+{
+    tolua_Box* box;
+    if (lua_type(L,lo) != LUA_TUSERDATA || lua_objlen(L,lo) < sizeof(tolua_Box))
+        return NULL;
+    box = (tolua_Box*)lua_touserdata(L,lo);
+    return box->magic == TOLUA_BOX_MAGIC ? box : NULL;
+}
+
+/**
+ *  Get type id
+ *
+ *  查询已注册类型的id
+ *
+ *  @param L    状态机
+ *  @param type 类型名
+ *
+ *  @return 类型id，-1表示未注册
+ */
+TOLUA_API int tolua_typeid (lua_State* L, const char* type)
+{
+    return tolua_findtype(tolua_context(L),type);
+}
+
+/**
+ *  Get type name
+ *
+ *  @param L  状态机
+ *  @param id 类型id
+ *
+ *  @return 类型名，id无效返回NULL
+ */
+TOLUA_API const char* tolua_typeidname (lua_State* L, int id)
+{
+    tolua_Context* ctx = tolua_context(L);
+    tolua_Type* t;
+    if (id < 0 || tolua_typeindex(id) >= ctx->ntypes)
+        return NULL;
+    t = &ctx->types[tolua_typeindex(id)];
+    if (!(id & TOLUA_TYPE_CONST))
+        return t->name;
+    if (t->cname == NULL)
+    {
+        /* 第一次用到时才创建"const X" */
+        t->cname = (char*)malloc(strlen(t->name)+7);
+        if (t->cname == NULL)
+            return t->name;
+        strcpy(t->cname,"const ");
+        strcat(t->cname,t->name);
+    }
+    return t->cname;
+}
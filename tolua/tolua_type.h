@@ -0,0 +1,520 @@
+/* tolua: type registry
+** Support code for Lua bindings.
+** Written by Waldemar Celes
+** TeCGraf/PUC-Rio
+** Apr 2003
+** $Id: $
+*/
+
+/* This code is free software; you can redistribute it and/or modify it.
+** The software provided hereunder is on an "as is" basis, and
+** the author has no obligation to provide maintenance, support, updates,
+** enhancements, or modifications.
+*/
+
+#ifndef TOLUA_TYPE_H
+#define TOLUA_TYPE_H
+
+#include "tolua++.h"
+
+/* 对象表用c端的开放寻址散列表，为0时使用各个根类的tolua_ubox弱表 */
+#ifndef TOLUA_NATIVE_UBOX
+#define TOLUA_NATIVE_UBOX   1
+#endif
+
+/*
+ *  对象的peer表存放在用户数据上：lua5.1中是环境表，lua5.2以上是uservalue。
+ *  没有peer的对象指向TOLUA_NOPEER；lua5.2以上不是tolua创建的用户数据的uservalue为nil
+ */
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+/* uservalue路径还没有在真正的lua5.2以上跑过测试，确认之后才能去掉这个开关 */
+#ifndef TOLUA_UNTESTED_LUA52
+#error "tolua++: the lua 5.2+ uservalue peer path is untested; define TOLUA_UNTESTED_LUA52 to build it anyway"
+#endif
+#define tolua_getpeertable(L,lo)    lua_getuservalue(L,lo)
+#define tolua_setpeertable(L,lo)    lua_setuservalue(L,lo)
+#else
+#define tolua_getpeertable(L,lo)    lua_getfenv(L,lo)
+#define tolua_setpeertable(L,lo)    lua_setfenv(L,lo)
+#endif
+#define tolua_nopeer(L,lo)          (!lua_istable(L,lo) || lua_rawequal(L,lo,TOLUA_NOPEER))
+
+/* 外部内存每增加这么多字节推进一次垃圾回收，见tolua_report_external */
+#ifndef TOLUA_EXTERNAL_STEP
+#define TOLUA_EXTERNAL_STEP (64*1024)
+#endif
+
+/* 每个类的set函数缓存最多记住这么多个没有set函数的字符串键，
+   对象上的lua字段名不限，不能让缓存无限增长 */
+#ifndef TOLUA_MAXMISS
+#define TOLUA_MAXMISS       64
+#endif
+
+/* 用于识别tolua创建的用户数据 */
+#define TOLUA_BOX_MAGIC     0x746f6c75  /* "tolu" */
+
+/* 数据块标志 */
+#define TOLUA_BOX_HASPEER   0x1         /* 对象设置过peer表（lua中的成员） */
+#define TOLUA_BOX_VALUE     0x2         /* 值类型对象，c对象就存放在数据块后面 */
+#define TOLUA_BOX_OWNED     0x4         /* 对象由lua负责回收（tolua_register_gc） */
+#define TOLUA_BOX_DEAD      0x8         /* c对象已经析构（tolua_invalidate），ptr为NULL */
+#define TOLUA_BOX_RETAINED  0x10        /* 创建时按类的引用计数策略retain过，回收时release */
+#define TOLUA_BOX_SLOTPEER  0x20        /* peer表是按声明的字段创建的，数组部分存放声明的字段，见tolua_unslotpeer */
+
+/**
+ *  用户数据块
+ *
+ *  ptr必须是第一个字段，这样 *(void**)lua_touserdata(L,lo) 的旧写法依旧有效
+ */
+typedef struct tolua_Box
+{
+    void* ptr;              /* c对象地址 */
+    int type;               /* 类型id，const对象带有TOLUA_TYPE_CONST标志 */
+    unsigned int magic;     /* TOLUA_BOX_MAGIC */
+    unsigned int flags;     /* TOLUA_BOX_* */
+    int slot;               /* 在对象数组中的位置，0表示不在对象表中 */
+    lua_CFunction col;      /* TOLUA_BOX_OWNED时的回收函数，NULL表示回收时按元表查询 */
+    size_t ext;             /* 计入ctx->external的原生内存字节数，见tolua_chargebox */
+} tolua_Box;
+
+/* 和lua的LUAI_USER_ALIGNMENT_T相同，用户数据的起始地址按它对齐 */
+typedef union tolua_MaxAlign { double d; void* p; long l; } tolua_MaxAlign;
+
+/*
+ *  值类型的c对象在数据块中的偏移：sizeof(tolua_Box)向上取整到tolua_MaxAlign的整数倍。
+ *  32位平台上sizeof(tolua_Box)是28，直接放在后面double和int64成员不按8对齐，ARMv7上会出错
+ */
+#define TOLUA_BOX_HEADER    ((sizeof(tolua_Box) + sizeof(tolua_MaxAlign) - 1) / \
+                             sizeof(tolua_MaxAlign) * sizeof(tolua_MaxAlign))
+
+/* 编译期检查：偏移是tolua_MaxAlign的整数倍，也至少按8字节对齐 */
+typedef char tolua_box_header_check[(TOLUA_BOX_HEADER % sizeof(tolua_MaxAlign) == 0 &&
+                                     TOLUA_BOX_HEADER % 8 == 0) ? 1 : -1];
+
+/**
+ *  类型描述
+ */
+typedef struct tolua_Type
+{
+    char* name;             /* 类型名，由ctx持有 */
+    char* cname;            /* "const "+类型名，只在出错信息中用到，按需创建 */
+    int mt;                 /* 元表在registry中的引用，LUA_NOREF表示尚未创建 */
+    int ubox;               /* 对应tolua_ubox表的引用，第一次入栈时缓存 */
+    int nbases;             /* 直接基类数量 */
+    int* bases;             /* 直接基类id */
+    int firstsub;           /* 第一个以它为主基类的子类，-1表示没有 */
+    int nextsub;            /* 主基类相同的下一个子类，-1表示没有 */
+    int link;               /* 元表尚未链接到的基类id，-1表示没有 */
+    int mcache;             /* 展平的方法缓存表的引用，键 -> 方法所在的类表，找不到的键不缓存 */
+    int gcache;             /* 展平的get函数缓存表的引用，键 -> get函数或数组表 */
+    int scache;             /* 展平的set函数缓存表的引用，键 -> .set表，false表示没有 */
+    int nmiss;              /* scache中false项的数量，不超过TOLUA_MAXMISS */
+    int cachegen;           /* 缓存最后一次确认有效时的ctx->generation */
+    int stamp;              /* 类表最后一次变化时的ctx->generation */
+    const tolua_ArrayDef* array;    /* 数组协议，NULL表示没有 */
+    int sealed;             /* 密封的类，不能给对象设置不存在的成员 */
+    unsigned int size;      /* 值类型的大小，0表示不是值类型 */
+    int vmt;                /* 值类型对象的元表（没有__gc）的引用，第一次入栈时创建 */
+    int collect;            /* TOLUA_COLLECT_*，见tolua_collectmode */
+    tolua_Destructor dtor;  /* TOLUA_COLLECT_THREADSAFE时的析构函数 */
+    tolua_Destructor retain;    /* 引用计数策略，见tolua_refclass */
+    tolua_Destructor release;
+    tolua_ExternalSize extsize; /* 对象持有的原生内存，见tolua_extclass */
+    int slots;              /* 声明的lua端字段 名字->peer数组下标 表的引用，LUA_NOREF表示没有 */
+    int slotcount;          /* 声明的字段数量（包括继承的） */
+    int mark;               /* 计算祖先位集时的访问标记 */
+    const tolua_ClassDef* def;  /* 延迟注册的类描述，注册完成后为NULL */
+    int module;             /* 延迟注册的类所在模块表的引用 */
+} tolua_Type;
+
+/* 类型名指针缓存的大小，2的幂 */
+#define TOLUA_TYPECACHE     256
+
+/**
+ *  类型名指针缓存项
+ *
+ *  绑定代码中的类型名基本都是字符串常量，按指针直接命中
+ */
+typedef struct tolua_TypeCache
+{
+    const char* name;       /* 调用者传入的字符串指针 */
+    int id;                 /* 对应类型id */
+} tolua_TypeCache;
+
+/* 去掉const标志，得到types数组的下标 */
+#define tolua_typeindex(type)       ((type) & ~TOLUA_TYPE_CONST)
+
+/* 内存池每页的大小 */
+#define TOLUA_SLAB_PAGE     16384
+
+/**
+ *  内存池的页，每页只分配一种尺寸的块
+ */
+typedef struct tolua_SlabPage
+{
+    char* base;             /* 页首地址 */
+    int sclass;             /* 尺寸级别，-1表示直接malloc的大块 */
+    size_t size;            /* 页（或大块）的字节数 */
+    size_t used;            /* 页中正在使用的块数，为0时页可以归还 */
+} tolua_SlabPage;
+
+/**
+ *  按尺寸分级的内存池
+ *
+ *  tolua_copy、tolua_default_collect以及Mtolua_slab_new使用，避免每个临时对象都进出系统分配器
+ */
+typedef struct tolua_Slab
+{
+    void* free[TOLUA_SLAB_CLASSES];     /* 各级别的空闲块链表，链接指针存放在块的开头 */
+    size_t blocks[TOLUA_SLAB_CLASSES];  /* 各级别的块总数 */
+    size_t used[TOLUA_SLAB_CLASSES];    /* 各级别正在使用的块数 */
+    size_t large;                       /* 直接malloc、还没有释放的大块数 */
+    int npages;
+    int sizepages;
+    tolua_SlabPage* pages;              /* 页和大块，按首地址排序，释放时二分查找所在的页 */
+} tolua_Slab;
+
+/**
+ *  延迟回收的对象
+ */
+typedef struct tolua_Pending
+{
+    void* ptr;              /* c对象地址 */
+    int type;               /* 类型id */
+    lua_CFunction col;      /* 回收函数，dtor为NULL时使用 */
+    tolua_Destructor dtor;  /* 线程安全的析构函数 */
+} tolua_Pending;
+
+/**
+ *  延迟回收队列（环形）
+ */
+typedef struct tolua_Queue
+{
+    int size;               /* 容量，2的幂 */
+    int head;               /* 队首位置 */
+    int n;                  /* 对象数 */
+    tolua_Pending* items;
+} tolua_Queue;
+
+/**
+ *  对象表项：c对象地址+根类 -> 对象数组中的位置
+ */
+typedef struct tolua_BoxEntry
+{
+    void* ptr;              /* c对象地址，NULL表示空 */
+    int root;               /* 根类id */
+    int slot;               /* 对象数组中的位置 */
+} tolua_BoxEntry;
+
+/**
+ *  已经被回收、还没有调用__gc，并且不再能通过对象表找到的用户数据
+ *
+ *  表项被同一地址的新用户数据占用，或者c对象在这期间被tolua_invalidate
+ */
+typedef struct tolua_Tomb
+{
+    void* ptr;              /* c对象地址 */
+    int slot;               /* 用户数据在对象数组中的位置，__gc之前不会被复用 */
+    int dead;               /* c对象已经析构，__gc时不能再回收 */
+} tolua_Tomb;
+
+/**
+ *  每个lua_State（主状态机）对应一个上下文
+ *
+ *  以用户数据的方式存放在registry中，随状态机一起释放
+ */
+typedef struct tolua_Context
+{
+    int ntypes;             /* 已注册的类型数量 */
+    int sizetypes;          /* types数组容量 */
+    tolua_Type* types;      /* 以类型id为下标 */
+
+    int sizenames;          /* 名字散列表容量，2的幂 */
+    int* names;             /* 开放寻址散列表，值为类型id，-1表示空 */
+
+    tolua_TypeCache typecache[TOLUA_TYPECACHE];
+
+    int words;              /* 每个祖先位集的字数，sizetypes/32 */
+    unsigned int* ancestors;/* 祖先位集矩阵，第id行的第b位表示id是b的子类 */
+    int dirty;              /* 登记了新的继承关系，祖先位集需要重新计算 */
+    int generation;         /* 类表中成员或者继承关系发生变化时加一，成员缓存在下次访问时检查 */
+    int cached;             /* 已经有类型创建了成员缓存，之前的变化不需要记到具体的类上 */
+
+    tolua_Slab slab;        /* 对象内存池 */
+
+    int sizemap;            /* 对象表容量，2的幂 */
+    int nmap;               /* 对象表项数 */
+    tolua_BoxEntry* map;    /* 开放寻址散列表，线性探测 */
+    int boxes;              /* 对象数组（值弱引用）在registry中的引用，LUA_NOREF表示尚未创建 */
+    int nslots;             /* 对象数组中用过的最大位置 */
+    int nfree;              /* 空闲位置数量 */
+    int sizefree;
+    int* freeslots;         /* 空闲位置栈 */
+    int ntombs;
+    int sizetombs;
+    tolua_Tomb* tombs;      /* 等待__gc的用户数据，见tolua_reaptomb */
+
+    tolua_Queue collect;    /* 等待tolua_drain_collect的对象 */
+    tolua_Queue tscollect;  /* 可以在其它线程析构的对象，见tolua_take_collect */
+
+    size_t external;        /* lua负责回收的对象持有的原生内存总字节数 */
+    size_t extdebt;         /* 上次推进垃圾回收之后新增的原生内存字节数 */
+
+    int closed;             /* 上下文已经释放，之后tolua_free不再复用块，回收函数直接调用 */
+} tolua_Context;
+
+/* 类型id对应的祖先位集 */
+#define tolua_ancestors(ctx,id)     ((ctx)->ancestors + (size_t)(id)*(ctx)->words)
+#define tolua_testbit(set,b)        (((set)[(b)>>5] >> ((b)&31)) & 1u)
+#define tolua_setbit(set,b)         ((set)[(b)>>5] |= 1u << ((b)&31))
+
+/**
+ *  获得状态机对应的上下文，不存在则创建
+ */
+TOLUA_API tolua_Context* tolua_context (lua_State* L);
+
+/**
+ *  释放内存池中没有块在使用的页（实现在tolua_slab.c中）
+ *
+ *  上下文释放时调用。还有块在使用的页保留下来，c端持有的对象不会悬空；
+ *  之后的tolua_free只释放大块和malloc的内存
+ */
+TOLUA_API void tolua_slabclose (tolua_Context* ctx);
+
+/**
+ *  类型的根类，沿主基类查找（实现在tolua_ubox.c中，下同）
+ *
+ *  同一根类下的类共用对象，对应原来共用的tolua_ubox
+ */
+TOLUA_API int tolua_rootclass (tolua_Context* ctx, int type);
+
+/**
+ *  查询c对象对应的表项
+ *
+ *  @return 表项，NULL表示没有
+ */
+TOLUA_API tolua_BoxEntry* tolua_findbox (tolua_Context* ctx, void* ptr, int root);
+
+/**
+ *  将对象数组中slot处的用户数据入栈
+ *
+ *  @return 1 : 成功
+ *  @return 0 : 用户数据已经被回收（等待__gc），栈不变
+ */
+TOLUA_API int tolua_pushslot (lua_State* L, tolua_Context* ctx, int slot);
+
+/**
+ *  前提：用户数据在栈顶
+ *
+ *  将用户数据放入对象数组，并在对象表中登记，已有的表项直接指向新的位置
+ */
+TOLUA_API void tolua_mapbox (lua_State* L, tolua_Context* ctx, tolua_Box* box, int root);
+
+/**
+ *  用户数据被回收，从对象表中删除并释放它在对象数组中的位置
+ */
+TOLUA_API void tolua_unmapbox (tolua_Context* ctx, tolua_Box* box);
+
+/**
+ *  用户数据的__gc中、unmapbox之前调用（ctx->ntombs不为0时）
+ *
+ *  它等待__gc期间c对象被tolua_invalidate过时，去掉所有权和地址，不再回收
+ */
+TOLUA_API void tolua_reaptomb (tolua_Context* ctx, tolua_Box* box);
+
+/**
+ *  访问已经失效的对象（TOLUA_BOX_DEAD）时报错
+ */
+TOLUA_API int tolua_deaderror (lua_State* L, tolua_Box* box);
+
+/**
+ *  根类oldroot有了主基类，对象表中它的表项改到新的根类newroot下
+ */
+TOLUA_API void tolua_reroot (tolua_Context* ctx, int oldroot, int newroot);
+
+/**
+ *  查询对象的回收函数（实现在tolua_map.c中，下同）
+ *
+ *  @return 元表中的.collector，没有则是tolua_default_collect，NULL表示.collector是lua函数
+ */
+TOLUA_API lua_CFunction tolua_getcollector (lua_State* L, int lo);
+
+/**
+ *  按类型的回收方式把对象放入延迟回收队列
+ *
+ *  @return 1 : 已放入队列，不需要立即调用回收函数
+ *  @return 0 : 需要立即调用
+ */
+TOLUA_API int tolua_defercollect (tolua_Context* ctx, tolua_Box* box, lua_CFunction col, tolua_Destructor release);
+
+/**
+ *  对象交给lua回收（所有权或者retain）时，按类的extsize计入原生内存，不推进垃圾回收
+ */
+TOLUA_API void tolua_chargebox (tolua_Context* ctx, tolua_Box* box);
+
+/**
+ *  对象不再由lua回收时减去它计入的原生内存
+ */
+TOLUA_API void tolua_unchargebox (tolua_Context* ctx, tolua_Box* box);
+
+/**
+ *  新增的原生内存足够多时按比例推进垃圾回收，可能调用__gc
+ */
+TOLUA_API void tolua_stepexternal (lua_State* L, tolua_Context* ctx);
+
+/**
+ *  调用队列中所有对象的回收函数并释放队列（上下文释放时调用）
+ */
+TOLUA_API void tolua_closecollect (lua_State* L, tolua_Context* ctx);
+
+/**
+ *  c对象已经析构（tolua_invalidate），去掉延迟回收队列中它的回收函数和release
+ *
+ *  @return 去掉的数量
+ */
+TOLUA_API int tolua_dropcollect (tolua_Context* ctx, void* ptr);
+
+/**
+ *  释放对象表（上下文释放时调用）
+ */
+TOLUA_API void tolua_boxclose (tolua_Context* ctx);
+
+/**
+ *  查询类型名对应的id
+ *
+ *  "const X" 返回 X的id | TOLUA_TYPE_CONST
+ *
+ *  @return 类型id，-1表示未注册
+ */
+TOLUA_API int tolua_findtype (tolua_Context* ctx, const char* name);
+
+/**
+ *  注册类型名，已存在则直接返回对应id
+ */
+TOLUA_API int tolua_interntype (lua_State* L, const char* name);
+
+/**
+ *  将类型对应的tolua_ubox表入栈
+ *
+ *  第一次调用时在registry中保留引用，之后直接通过引用获得
+ */
+TOLUA_API void tolua_pushubox (lua_State* L, tolua_Context* ctx, int type);
+
+/**
+ *  类型的tolua_ubox表发生变化，清除缓存的引用
+ */
+TOLUA_API void tolua_resetubox (lua_State* L, int type);
+
+/**
+ *  记录 type 继承自 base
+ *
+ *  只记录边，祖先位集在下一次tolua_typeisa或tolua_finalize_types时统一计算
+ */
+TOLUA_API void tolua_typebase (lua_State* L, int type, int base);
+
+/**
+ *  按拓扑顺序重新计算所有类型的祖先位集
+ */
+TOLUA_API void tolua_typeclosure (tolua_Context* ctx);
+
+/**
+ *  类型a是否为类型b，或者b的子类
+ *
+ *  只做一次位测试。const的a只能是const的b
+ *
+ *  有新的继承关系时先重新计算祖先位集
+ */
+TOLUA_API int tolua_typeisa (tolua_Context* ctx, int a, int b);
+
+/**
+ *  注册延迟注册的类型（及其基类），已经注册的类型什么都不做
+ *
+ *  实现在tolua_map.c中
+ */
+TOLUA_API void tolua_materialize (lua_State* L, int type);
+
+/**
+ *  将值类型对象的元表入栈，不存在则创建（实现在tolua_map.c中）
+ *
+ *  元表的元表是类的元表，成员沿元表链查找，只是没有__gc
+ */
+TOLUA_API void tolua_pushvaluemt (lua_State* L, int type);
+
+/* 值类型对象中c对象的地址，紧跟在数据块后面 */
+#define tolua_valuedata(box)        ((void*)((char*)(box) + TOLUA_BOX_HEADER))
+
+/* 类型是否还在等待延迟注册 */
+#define tolua_ispending(ctx,type)   ((ctx)->types[tolua_typeindex(type)].def != NULL)
+
+/**
+ *  类型id的类表中成员或者继承关系发生了变化，它和子类的成员缓存在下次访问时重建，
+ *  其它类的缓存不受影响
+ */
+TOLUA_API void tolua_touchtype (tolua_Context* ctx, int id);
+
+/**
+ *  栈中lo处的表中加入了成员，是类表时相当于tolua_touchtype，模块表不影响成员缓存
+ */
+TOLUA_API void tolua_touchmembers (lua_State* L, tolua_Context* ctx, int lo);
+
+/**
+ *  获得类型的成员缓存，缓存过期则重新创建
+ *
+ *  @return 类型描述，mcache、gcache和scache可以直接使用
+ */
+TOLUA_API tolua_Type* tolua_membercache (lua_State* L, tolua_Context* ctx, int type);
+
+/**
+ *  查询类型的数组协议，自己没有则沿主基类查找
+ *
+ *  @return 数组协议，NULL表示没有
+ */
+TOLUA_API const tolua_ArrayDef* tolua_arraydef (tolua_Context* ctx, int type);
+
+/**
+ *  查询类型声明的lua端字段，自己没有声明则沿主基类查找
+ *
+ *  @return 声明了字段的类型，NULL表示没有
+ */
+TOLUA_API tolua_Type* tolua_slotpolicy (tolua_Context* ctx, int type);
+
+/**
+ *  对象的peer表不再按声明的字段存放，声明的字段改为以名字为键（实现在tolua_event.c中）
+ */
+TOLUA_API void tolua_unslotpeer (lua_State* L, tolua_Box* box, int lo);
+
+/**
+ *  查询类型的引用计数策略，自己没有则沿主基类查找
+ *
+ *  @return 设置了策略的类型，NULL表示没有
+ */
+TOLUA_API tolua_Type* tolua_refpolicy (tolua_Context* ctx, int type);
+
+/* 数组首元素地址 */
+#define tolua_arraydata(def,self)   ((def)->data ? (def)->data(self) : (self))
+
+/**
+ *  将数组中第i个元素入栈（实现在tolua_push.c中）
+ */
+TOLUA_API void tolua_pushelem (lua_State* L, const tolua_ArrayDef* def, void* data, int i);
+
+/**
+ *  用lo处的值设置数组中第i个元素（实现在tolua_to.c中）
+ *
+ *  类型不对时报错
+ */
+TOLUA_API void tolua_setelem (lua_State* L, const tolua_ArrayDef* def, void* data, int i, int lo);
+
+/**
+ *  查询元表对应的类型id
+ *
+ *  @return 类型id，-1表示不是tolua的元表
+ */
+TOLUA_API int tolua_mttype (lua_State* L, int mt);
+
+/**
+ *  若lo处是tolua创建的用户数据，返回对应的数据块，否则返回NULL
+ */
+TOLUA_API tolua_Box* tolua_tobox (lua_State* L, int lo);
+
+#endif
@@ -0,0 +1,535 @@
+/* tolua: object table
+** Support code for Lua bindings.
+** Written by Waldemar Celes
+** TeCGraf/PUC-Rio
+** Apr 2003
+** $Id: $
+*/
+
+/* This code is free software; you can redistribute it and/or modify it.
+** The software provided hereunder is on an "as is" basis, and
+** the author has no obligation to provide maintenance, support, updates,
+** enhancements, or modifications.
+*/
+
+#include "tolua++.h"
+#include "tolua_type.h"
+#include "lauxlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  c对象地址 -> 用户数据 的映射
+ *
+ *  lua 5.1 的c接口不能持有对lua对象的弱引用，所以用户数据本身放在一个值弱引用的数组中，
+ *  c端的散列表只记录 地址+根类 -> 数组位置。数组只用整数键，增长时不需要对地址重新散列。
+ *  用户数据的__gc中删除表项并归还位置
+ */
+
+/**
+ *  地址散列
+ *
+ *  只按地址散列，同一地址不同根类的表项在同一条探测序列上，
+ *  tolua_invalidate可以一次找到它们。
+ *
+ *  对象地址按分配器的粒度对齐，低位几乎不变，而表中直接用低位做下标，
+ *  所以先把高32位折进来，再用murmur3的fmix32让每一位都影响低位
+ *
+ *  @param ptr  c对象地址
+ *
+ *  @return 散列值
+ */
+static unsigned int hashbox (void* ptr)
+{
+    size_t p = (size_t)ptr;
+    unsigned int h = (unsigned int)(p ^ (p >> 16 >> 16));
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ *  类型的根类，沿主基类查找
+ *
+ *  @param ctx  上下文
+ *  @param type 类型id
+ *
+ *  @return 根类id
+ */
+TOLUA_API int tolua_rootclass (tolua_Context* ctx, int type)
+{
+    tolua_Type* t = &ctx->types[tolua_typeindex(type)];
+    int n = ctx->ntypes;                    /* 防止继承关系成环 */
+    while (t->nbases > 0 && n-- > 0)
+        t = &ctx->types[t->bases[0]];
+    return (int)(t - ctx->types);
+}
+
+/**
+ *  查询c对象对应的表项
+ *
+ *  @param ctx  上下文
+ *  @param ptr  c对象地址
+ *  @param root 根类id
+ *
+ *  @return 表项，NULL表示没有
+ */
+TOLUA_API tolua_BoxEntry* tolua_findbox (tolua_Context* ctx, void* ptr, int root)
+{
+    unsigned int mask, i;
+    if (ctx->nmap == 0)
+        return NULL;
+    mask = (unsigned int)ctx->sizemap - 1;
+    for (i = hashbox(ptr) & mask; ctx->map[i].ptr; i = (i + 1) & mask)
+    {
+        if (ctx->map[i].ptr == ptr && ctx->map[i].root == root)
+            return &ctx->map[i];
+    }
+    return NULL;
+}
+
+/**
+ *  插入表项，调用者保证表中没有相同的键并且有空位
+ *
+ *  @return 新的表项
+ */
+static tolua_BoxEntry* insertbox (tolua_Context* ctx, void* ptr, int root, int slot)
+{
+    unsigned int mask = (unsigned int)ctx->sizemap - 1;
+    unsigned int i = hashbox(ptr) & mask;
+    while (ctx->map[i].ptr)
+        i = (i + 1) & mask;
+    ctx->map[i].ptr = ptr;
+    ctx->map[i].root = root;
+    ctx->map[i].slot = slot;
+    ctx->nmap++;
+    return &ctx->map[i];
+}
+
+/**
+ *  对象表扩容，保证装载因子不超过1/2
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ */
+static void growmap (lua_State* L, tolua_Context* ctx)
+{
+    tolua_BoxEntry* old = ctx->map;
+    int sizeold = ctx->sizemap;
+    int size = sizeold ? sizeold*2 : 256;
+    int i;
+    tolua_BoxEntry* map = (tolua_BoxEntry*)calloc(size,sizeof(tolua_BoxEntry));
+    if (map == NULL)
+        tolua_error(L,"insuficient memory",NULL);
+    ctx->map = map;
+    ctx->sizemap = size;
+    ctx->nmap = 0;
+    for (i=0; i<sizeold; ++i)
+        if (old[i].ptr)
+            insertbox(ctx,old[i].ptr,old[i].root,old[i].slot);
+    free(old);
+}
+
+/**
+ *  删除表项，后面同一探测序列上的表项前移，不留墓碑
+ *
+ *  @param ctx 上下文
+ *  @param e   表项
+ */
+static void removebox (tolua_Context* ctx, tolua_BoxEntry* e)
+{
+    unsigned int mask = (unsigned int)ctx->sizemap - 1;
+    unsigned int i = (unsigned int)(e - ctx->map);
+    unsigned int j = i;
+    ctx->map[i].ptr = NULL;
+    ctx->nmap--;
+    for (;;)
+    {
+        unsigned int k;
+        j = (j + 1) & mask;
+        if (ctx->map[j].ptr == NULL)
+            break;
+        k = hashbox(ctx->map[j].ptr) & mask;
+        /* k不在(i,j]之间时，j处的表项可以移到i */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        ctx->map[i] = ctx->map[j];
+        ctx->map[j].ptr = NULL;
+        i = j;
+    }
+}
+
+/**
+ *  根类oldroot有了主基类，它和子类的对象改用新的根类newroot为键
+ *
+ *  表项只按地址散列，改键不需要移动；同一地址在newroot下已经有表项时
+ *  删除旧的表项，它的用户数据不再能通过地址找到，__gc时只归还位置
+ *
+ *  @param ctx     上下文
+ *  @param oldroot 原来的根类id
+ *  @param newroot 新的根类id
+ */
+TOLUA_API void tolua_reroot (tolua_Context* ctx, int oldroot, int newroot)
+{
+    int i = 0;
+    if (oldroot == newroot)
+        return;
+    while (i < ctx->sizemap)
+    {
+        tolua_BoxEntry* e = &ctx->map[i];
+        if (e->ptr == NULL || e->root != oldroot)
+            ++i;
+        else if (tolua_findbox(ctx,e->ptr,newroot))
+            removebox(ctx,e);               /* 后面的表项可能移到i，不前进 */
+        else
+        {
+            e->root = newroot;
+            ++i;
+        }
+    }
+}
+
+/**
+ *  归还对象数组中的位置
+ *
+ *  @param ctx  上下文
+ *  @param slot 位置
+ */
+static void freeslot (tolua_Context* ctx, int slot)
+{
+    if (ctx->nfree >= ctx->sizefree)
+    {
+        int size = ctx->sizefree ? ctx->sizefree*2 : 256;
+        int* freeslots = (int*)realloc(ctx->freeslots,size*sizeof(int));
+        if (freeslots == NULL)              /* 可能在__gc中，不能报错，放弃这个位置 */
+            return;
+        ctx->freeslots = freeslots;
+        ctx->sizefree = size;
+    }
+    ctx->freeslots[ctx->nfree++] = slot;
+}
+
+/**
+ *  数据块失效：地址置为NULL，去掉所有权、计入的原生内存和对象表中的位置
+ *
+ *  @param ctx 上下文
+ *  @param box 数据块，可为NULL
+ */
+static void killbox (tolua_Context* ctx, tolua_Box* box)
+{
+    if (box == NULL)
+        return;
+    tolua_unchargebox(ctx,box);
+    box->ptr = NULL;
+    box->flags = (box->flags & ~(TOLUA_BOX_OWNED | TOLUA_BOX_RETAINED)) | TOLUA_BOX_DEAD;
+    box->col = NULL;
+    box->slot = 0;
+}
+
+/**
+ *  记录等待__gc的用户数据
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param ptr  c对象地址
+ *  @param slot 用户数据在对象数组中的位置
+ *  @param dead c对象已经析构
+ */
+static void addtomb (lua_State* L, tolua_Context* ctx, void* ptr, int slot, int dead)
+{
+    if (ctx->ntombs >= ctx->sizetombs)
+    {
+        int size = ctx->sizetombs ? ctx->sizetombs*2 : 16;
+        tolua_Tomb* tombs = (tolua_Tomb*)realloc(ctx->tombs,size*sizeof(tolua_Tomb));
+        if (tombs == NULL)
+            tolua_error(L,"insuficient memory",NULL);
+        ctx->tombs = tombs;
+        ctx->sizetombs = size;
+    }
+    ctx->tombs[ctx->ntombs].ptr = ptr;
+    ctx->tombs[ctx->ntombs].slot = slot;
+    ctx->tombs[ctx->ntombs].dead = dead;
+    ctx->ntombs++;
+}
+
+/**
+ *  用户数据的__gc
+ *
+ *  在墓碑中的数据块删除墓碑，c对象已经析构的同时失效，
+ *  它的位置不在对象表中，这里直接归还
+ *
+ *  @param ctx 上下文
+ *  @param box 数据块
+ */
+TOLUA_API void tolua_reaptomb (tolua_Context* ctx, tolua_Box* box)
+{
+    int i;
+    if (box->slot == 0)
+        return;
+    for (i=0; i<ctx->ntombs; ++i)
+    {
+        if (ctx->tombs[i].slot != box->slot)
+            continue;
+        if (ctx->tombs[i].dead)
+        {
+            freeslot(ctx,box->slot);
+            killbox(ctx,box);
+        }
+        ctx->tombs[i] = ctx->tombs[--ctx->ntombs];
+        return;
+    }
+}
+
+/**
+ *  将对象数组入栈，不存在则创建
+ *
+ *  reg[ctx->boxes] = setmetatable({}, {__mode = "v"})
+ *
+ *  @param L   状态机
+ *  @param ctx 上下文
+ */
+static void pushboxes (lua_State* L, tolua_Context* ctx)
+{
+    if (ctx->boxes == LUA_NOREF)
+    {
+        lua_createtable(L,256,0);
+        lua_createtable(L,0,1);
+        lua_pushliteral(L,"__mode");
+        lua_pushliteral(L,"v");
+        lua_rawset(L,-3);
+        lua_setmetatable(L,-2);
+        lua_pushvalue(L,-1);
+        ctx->boxes = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    else
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ctx->boxes);
+}
+
+/**
+ *  将对象数组中slot处的用户数据入栈
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param slot 位置
+ *
+ *  @return 1 : 成功
+ *  @return 0 : 用户数据已经被回收（等待__gc），栈不变
+ */
+TOLUA_API int tolua_pushslot (lua_State* L, tolua_Context* ctx, int slot)
+{
+    pushboxes(L,ctx);
+    lua_rawgeti(L,-1,slot);                 /* stack: boxes ud */
+    lua_remove(L,-2);
+    if (lua_isnil(L,-1))
+    {
+        lua_pop(L,1);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ *  前提：用户数据在栈顶
+ *
+ *  将用户数据放入对象数组，并在对象表中登记。
+ *  已有的表项（旧的用户数据已被回收，还没有调用__gc）直接指向新的位置
+ *
+ *  @param L    状态机
+ *  @param ctx  上下文
+ *  @param box  数据块
+ *  @param root 根类id
+ */
+TOLUA_API void tolua_mapbox (lua_State* L, tolua_Context* ctx, tolua_Box* box, int root)
+{
+    tolua_BoxEntry* e;
+    int slot;
+
+    /* 分配位置，优先使用__gc归还的位置 */
+    if (ctx->nfree > 0)
+        slot = ctx->freeslots[--ctx->nfree];
+    else
+        slot = ++ctx->nslots;
+
+    pushboxes(L,ctx);
+    lua_pushvalue(L,-2);
+    lua_rawseti(L,-2,slot);                 /* boxes[slot] = ud */
+    lua_pop(L,1);
+
+    e = tolua_findbox(ctx,box->ptr,root);
+    if (e)
+    {
+        /* 旧的用户数据还在等待__gc，记下它，tolua_invalidate还要能找到 */
+        if (tolua_pushslot(L,ctx,e->slot))
+            lua_pop(L,1);
+        else
+            addtomb(L,ctx,box->ptr,e->slot,0);
+        e->slot = slot;
+    }
+    else
+    {
+        if ((ctx->nmap + 1) * 2 > ctx->sizemap)
+            growmap(L,ctx);
+        insertbox(ctx,box->ptr,root,slot);
+    }
+    box->slot = slot;
+}
+
+/**
+ *  用户数据被回收
+ *
+ *  表项仍指向这个用户数据时删除表项；无论如何都归还位置，
+ *  此时数组中这个位置的弱引用已经被清除
+ *
+ *  @param ctx 上下文
+ *  @param box 数据块
+ */
+TOLUA_API void tolua_unmapbox (tolua_Context* ctx, tolua_Box* box)
+{
+    tolua_BoxEntry* e;
+    if (box->slot == 0 || ctx->sizemap == 0)    /* 不在表中，或者上下文已经释放 */
+        return;
+
+    e = tolua_findbox(ctx,box->ptr,tolua_rootclass(ctx,box->type));
+    if (e && e->slot == box->slot)
+        removebox(ctx,e);
+
+    freeslot(ctx,box->slot);
+    box->slot = 0;
+}
+
+/**
+ *  Invalidate a native object
+ *
+ *  c对象被析构时调用（如在析构函数中），所有指向它的数据块：
+ *  地址置为NULL并标记为TOLUA_BOX_DEAD，去掉所有权（不会再调用回收函数），
+ *  从对象表和reg.tolua_value_root中删除。之后lua中对这些对象的访问
+ *  在tolua_isusertype检查时失败，tolua_tousertype返回NULL
+ *
+ *  同一地址的表项都在同一条探测序列上，时间与序列长度成正比。
+ *  已经被回收、还没有调用__gc的用户数据记为墓碑，__gc时失效，不会重复回收；
+ *  已经__gc、在延迟回收队列中等待的对象从队列中去掉（见tolua_dropcollect）。
+ *
+ *  TOLUA_NATIVE_UBOX为0时没有c端的对象表，要逐个查询压入过对象的类型的tolua_ubox弱表，
+ *  时间与这些类型的数量成正比，不是O(1)；等待__gc的用户数据已经从弱表中清除，找不到，
+ *  c对象析构前要先releaseownership
+ *
+ *  @param L   状态机
+ *  @param ptr c对象地址
+ *
+ *  @return 失效的数据块数量
+ */
+TOLUA_API int tolua_invalidate (lua_State* L, void* ptr)
+{
+    tolua_Context* ctx = tolua_context(L);
+    int n = 0;
+
+    if (ptr == NULL)
+        return 0;
+    tolua_remove_value_from_root(L,ptr);
+    if (ctx->collect.n > 0 || ctx->tscollect.n > 0)
+        tolua_dropcollect(ctx,ptr);
+
+#if TOLUA_NATIVE_UBOX
+    if (ctx->nmap > 0)
+    {
+        unsigned int mask = (unsigned int)ctx->sizemap - 1;
+        unsigned int i = hashbox(ptr) & mask;
+        while (ctx->map[i].ptr)
+        {
+            tolua_BoxEntry* e = &ctx->map[i];
+            if (e->ptr != ptr)
+            {
+                i = (i + 1) & mask;
+                continue;
+            }
+            if (tolua_pushslot(L,ctx,e->slot))          /* stack: ud */
+            {
+                tolua_Box* box = tolua_tobox(L,-1);
+                lua_pop(L,1);
+                /* 根类变化后留下的旧表项，位置可能已经给了别的对象 */
+                if (box->ptr == ptr)
+                {
+                    killbox(ctx,box);
+                    ++n;
+                    /* boxes[slot] = nil，归还位置 */
+                    pushboxes(L,ctx);
+                    lua_pushnil(L);
+                    lua_rawseti(L,-2,e->slot);
+                    lua_pop(L,1);
+                    freeslot(ctx,e->slot);
+                }
+            }
+            else                                        /* 用户数据等待__gc */
+                addtomb(L,ctx,ptr,e->slot,1);
+            /* 删除后后面的表项可能移到i，不前进 */
+            removebox(ctx,e);
+        }
+    }
+    /* 表项已经被新的用户数据占用的旧用户数据 */
+    {
+        int i;
+        for (i=0; i<ctx->ntombs; ++i)
+            if (ctx->tombs[i].ptr == ptr)
+                ctx->tombs[i].dead = 1;
+    }
+#else
+    {
+        /* 对象只能通过tolua_pushubox放入弱表，没有缓存引用的类型不会有对象，
+           跳过它们，也不会为它们新建引用 */
+        int i;
+        for (i=0; i<ctx->ntypes; ++i)
+        {
+            if (ctx->types[i].ubox == LUA_NOREF)
+                continue;
+            tolua_pushubox(L,ctx,i);                    /* stack: ubox */
+            lua_pushlightuserdata(L,ptr);
+            lua_rawget(L,-2);                           /* stack: ubox ud */
+            if (!lua_isnil(L,-1))
+            {
+                killbox(ctx,tolua_tobox(L,-1));
+                ++n;
+                lua_pushlightuserdata(L,ptr);
+                lua_pushnil(L);
+                lua_rawset(L,-4);                       /* ubox[ptr] = nil */
+            }
+            lua_pop(L,2);
+        }
+    }
+#endif
+    return n;
+}
+
+/**
+ *  访问已经失效（tolua_invalidate）的对象时报错，不返回
+ *
+ *  @param L   状态机
+ *  @param box 失效的数据块
+ */
+TOLUA_API int tolua_deaderror (lua_State* L, tolua_Box* box)
+{
+    tolua_Context* ctx = tolua_context(L);
+    return luaL_error(L,"attempt to use an invalidated '%s' object",
+                      ctx->types[tolua_typeindex(box->type)].name);
+}
+
+/**
+ *  释放对象表
+ *
+ *  @param ctx 上下文
+ */
+TOLUA_API void tolua_boxclose (tolua_Context* ctx)
+{
+    free(ctx->map);
+    free(ctx->freeslots);
+    free(ctx->tombs);
+    ctx->map = NULL;
+    ctx->freeslots = NULL;
+    ctx->tombs = NULL;
+    ctx->ntombs = ctx->sizetombs = 0;
+    ctx->sizemap = ctx->nmap = 0;
+    ctx->sizefree = ctx->nfree = 0;
+}